@@ -0,0 +1,495 @@
+/*
+ * Benchmark of the keyring pipelines against a private Secret Service.
+ *
+ * The plugin source is included directly, so the static pipelines can be
+ * driven without a messenger. Run it through `make bench`, which starts a
+ * private session bus with a stand-in Secret Service (bench/run-bench.sh).
+ *
+ * Usage: purple-gnome-keyring-bench [-i iterations] [-w window] [accounts ...]
+ *        purple-gnome-keyring-bench -s cycles [accounts]
+ *
+ * With -s, store / load / delete cycles are run instead (soak test), once with
+ * lazy and once with eager init. It fails if the RSS or the live object counts
+ * of the plugin grow after warm-up.
+ */
+
+#include "../purple-gnome-keyring.c"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../headless.h"
+
+#define BENCH_UI "purple-gnome-keyring-bench"
+#define BENCH_PROTOCOL "prpl-bench"
+#define BENCH_TIMEOUT 120 // seconds until a scenario is considered stuck
+#define SOAK_WARMUP 1000 // cycles before the baseline is taken
+#define SOAK_RSS_SLACK (1024 * 1024) // bytes of RSS growth tolerated after warm-up
+
+// Vars
+static gint dbus_calls = 0;     // outgoing method calls
+static gint dbus_in_flight = 0; // method calls without reply
+static guint bench_iterations = 5;
+static guint bench_window = KEYRING_BULK_WINDOW_DEFAULT;
+static guint soak_cycles = 0;
+static PurplePlugin* bench_plugin = NULL;
+
+/**************************************************
+ **************************************************
+ ***************** Event loop *********************
+ **************************************************
+ **************************************************/
+
+// Count D-Bus method calls on the connection libsecret uses
+static GDBusMessage* count_dbus_calls(GDBusConnection* connection,
+    GDBusMessage* message,
+    gboolean incoming,
+    gpointer user_data)
+{
+    GDBusMessageType type = g_dbus_message_get_message_type(message);
+
+    if (!incoming && (type == G_DBUS_MESSAGE_TYPE_METHOD_CALL)) {
+        g_atomic_int_inc(&dbus_calls);
+        g_atomic_int_inc(&dbus_in_flight);
+    } else if (incoming && ((type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) || (type == G_DBUS_MESSAGE_TYPE_ERROR))) {
+        g_atomic_int_add(&dbus_in_flight, -1);
+    }
+
+    return message;
+}
+
+// Iterate the main loop until cond is met, FALSE on timeout
+static gboolean run_until(gboolean (*cond)(void))
+{
+    gint64 deadline = g_get_monotonic_time() + (gint64)BENCH_TIMEOUT * G_USEC_PER_SEC;
+
+    while (!cond()) {
+        if (g_get_monotonic_time() > deadline)
+            return FALSE;
+        g_main_context_iteration(NULL, TRUE);
+    }
+
+    return TRUE;
+}
+
+static gboolean is_dbus_idle(void)
+{
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    return g_atomic_int_get(&dbus_in_flight) <= 0;
+}
+
+// Wait until all follow-up calls of a scenario are done
+static void drain(void)
+{
+    if (!run_until(is_dbus_idle))
+        fprintf(stderr, "Timeout while waiting for %i D-Bus calls\n", g_atomic_int_get(&dbus_in_flight));
+}
+
+static void fail(const gchar* msg)
+{
+    fprintf(stderr, "Benchmark failed: %s\n", msg);
+    exit(1);
+}
+
+/**************************************************
+ **************************************************
+ ******************* Reporting ********************
+ **************************************************
+ **************************************************/
+
+static gint compare_samples(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64*)a;
+    gint64 y = *(const gint64*)b;
+
+    return (x > y) - (x < y);
+}
+
+static gdouble percentile(GArray* samples, guint p)
+{
+    if (samples->len == 0)
+        return 0;
+
+    return g_array_index(samples, gint64, (samples->len - 1) * p / 100) / 1000.0;
+}
+
+static void report(const gchar* scenario, guint accounts, GArray* samples, gint calls, guint errors)
+{
+    g_array_sort(samples, compare_samples);
+
+    printf("%-20s %8u %8u %12.3f %12.3f %10i %8u\n",
+        scenario,
+        accounts,
+        samples->len,
+        percentile(samples, 50),
+        percentile(samples, 99),
+        calls,
+        errors);
+    fflush(stdout);
+}
+
+/**************************************************
+ **************************************************
+ ************** Pipeline scenarios ****************
+ **************************************************
+ **************************************************/
+
+// Windowed run of one pipeline over all accounts, like a bulk operation
+typedef struct {
+    void (*start)(PipelineCall* call);
+    GQueue accounts;
+    guint in_flight;
+    guint errors;
+    GArray* samples;
+} BenchRun;
+
+typedef struct {
+    BenchRun* run;
+    gint64 started;
+} BenchOp;
+
+static BenchRun* current_run = NULL;
+
+static void on_bench_op_done(PurpleAccount* account, const GError* error, gboolean skipped, gpointer user_data)
+{
+    BenchOp* op = (BenchOp*)user_data;
+    gint64 elapsed = g_get_monotonic_time() - op->started;
+
+    g_array_append_val(op->run->samples, elapsed);
+    if (error != NULL)
+        op->run->errors++;
+
+    op->run->in_flight--;
+    g_free(op);
+}
+
+static gboolean is_run_done(void)
+{
+    while ((current_run->in_flight < bench_window) && !g_queue_is_empty(&current_run->accounts)) {
+        BenchOp* op = g_new0(BenchOp, 1);
+        op->run = current_run;
+        op->started = g_get_monotonic_time();
+
+        current_run->in_flight++;
+        current_run->start(pipeline_call_new(g_queue_pop_head(&current_run->accounts), NULL, on_bench_op_done, op));
+    }
+
+    return (current_run->in_flight == 0) && g_queue_is_empty(&current_run->accounts);
+}
+
+// Run a pipeline over all accounts, returns the number of failed calls
+static guint run_pipeline(const gchar* scenario, GList* accounts, void (*start)(PipelineCall* call), GArray* samples)
+{
+    BenchRun run = { start, G_QUEUE_INIT, 0, 0, samples };
+
+    for (GList* li = accounts; li != NULL; li = li->next)
+        g_queue_push_tail(&run.accounts, li->data);
+
+    current_run = &run;
+    if (!run_until(is_run_done))
+        fail(scenario);
+    drain();
+    current_run = NULL;
+
+    return run.errors;
+}
+
+static void bench_pipeline(const gchar* scenario, GList* accounts, void (*start)(PipelineCall* call))
+{
+    GArray* samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+    gint calls = g_atomic_int_get(&dbus_calls);
+    guint errors = run_pipeline(scenario, accounts, start, samples);
+
+    report(scenario, g_list_length(accounts), samples, g_atomic_int_get(&dbus_calls) - calls, errors);
+    g_array_free(samples, TRUE);
+}
+
+// Give every account a new password, so stores are not skipped as unchanged
+static void set_passwords(GList* accounts, guint round)
+{
+    for (GList* li = accounts; li != NULL; li = li->next) {
+        PurpleAccount* account = li->data;
+        gchar* password = g_strdup_printf("bench-%s-%u", purple_account_get_username(account), round);
+
+        purple_account_set_password(account, password);
+        g_free(password);
+    }
+}
+
+static void clear_passwords(GList* accounts)
+{
+    for (GList* li = accounts; li != NULL; li = li->next)
+        purple_account_set_password(li->data, NULL);
+}
+
+/**************************************************
+ **************************************************
+ *************** Startup scenario *****************
+ **************************************************
+ **************************************************/
+
+static gboolean is_startup_done(void)
+{
+    return (plugin_collection != NULL) && (g_hash_table_size(init_pending) == 0);
+}
+
+// Full plugin start: service, collection, unlock and init of all accounts
+static void bench_startup(const gchar* scenario, GList* accounts, gboolean use_item_paths)
+{
+    GArray* samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+    gint calls = 0;
+    guint errors = 0;
+
+    for (guint i = 0; i < bench_iterations; i++) {
+        plugin_unload(bench_plugin);
+        drain();
+
+        if (!use_item_paths)
+            purple_prefs_set_string_list(KEYRING_ITEM_PATHS_PREF, NULL);
+        clear_passwords(accounts);
+
+        gint start_calls = g_atomic_int_get(&dbus_calls);
+        gint64 started = g_get_monotonic_time();
+
+        plugin_load(bench_plugin);
+        if (!run_until(is_startup_done))
+            fail(scenario);
+
+        gint64 elapsed = g_get_monotonic_time() - started;
+        g_array_append_val(samples, elapsed);
+
+        drain();
+        calls += g_atomic_int_get(&dbus_calls) - start_calls;
+
+        for (GList* li = accounts; li != NULL; li = li->next) {
+            if (purple_account_get_password(li->data) == NULL)
+                errors++;
+        }
+    }
+
+    report(scenario, g_list_length(accounts), samples, calls / (gint)MAX(bench_iterations, 1), errors);
+    g_array_free(samples, TRUE);
+}
+
+/**************************************************
+ **************************************************
+ ***************** Benchmark run ******************
+ **************************************************
+ **************************************************/
+
+static GList* create_accounts(guint count)
+{
+    GList* accounts = NULL;
+
+    for (guint i = 0; i < count; i++) {
+        gchar* username = g_strdup_printf("bench-user-%u@example.org", i);
+        PurpleAccount* account = purple_account_new(username, BENCH_PROTOCOL);
+
+        purple_account_set_remember_password(account, FALSE);
+        purple_accounts_add(account);
+        purple_account_set_enabled(account, purple_core_get_ui(), TRUE);
+
+        accounts = g_list_prepend(accounts, account);
+        g_free(username);
+    }
+
+    // Scenarios drive the pipelines themselves, drop the stores queued by account-added
+    if (store_flush_timer != 0) {
+        purple_timeout_remove(store_flush_timer);
+        store_flush_timer = 0;
+    }
+    g_hash_table_remove_all(pending_stores);
+
+    return g_list_reverse(accounts);
+}
+
+static void delete_accounts(GList* accounts)
+{
+    for (GList* li = accounts; li != NULL; li = li->next)
+        purple_accounts_delete(li->data);
+
+    g_list_free(accounts);
+    drain();
+}
+
+static void bench_accounts(guint count)
+{
+    GList* accounts = create_accounts(count);
+
+    set_passwords(accounts, 0);
+    bench_pipeline("store", accounts, start_store_call);
+    bench_pipeline("store (unchanged)", accounts, start_store_call);
+    set_passwords(accounts, 1);
+    bench_pipeline("store (changed)", accounts, start_store_call);
+
+    bench_startup("startup (search)", accounts, FALSE);
+    bench_startup("startup (item paths)", accounts, TRUE);
+
+    clear_passwords(accounts);
+    bench_pipeline("load", accounts, start_load_call);
+
+    bench_pipeline("delete", accounts, start_delete_call);
+
+    delete_accounts(accounts);
+}
+
+/**************************************************
+ **************************************************
+ ****************** Soak test *********************
+ **************************************************
+ **************************************************/
+
+// Resident set size in bytes, 0 if unknown
+static glong read_rss(void)
+{
+    glong size = 0;
+    glong resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+
+    if (statm == NULL)
+        return 0;
+
+    if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void soak_accounts(guint count, gboolean lazy)
+{
+    GList* accounts = create_accounts(count);
+    GArray* samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+    guint warmup = MAX(MIN(SOAK_WARMUP, soak_cycles / 10), 1);
+    guint baseline[LIVE_COUNT];
+    glong baseline_rss = 0;
+    guint errors = 0;
+    gboolean grown = FALSE;
+
+    printf("soak: %u cycles of store / load / delete with %u accounts, %s init\n", soak_cycles, count, lazy ? "lazy" : "eager");
+
+    for (guint i = 0; i < soak_cycles; i++) {
+        set_passwords(accounts, i);
+        errors += run_pipeline("soak store", accounts, start_store_call, samples);
+        clear_passwords(accounts);
+        errors += run_pipeline("soak load", accounts, start_load_call, samples);
+        errors += run_pipeline("soak delete", accounts, start_delete_call, samples);
+        g_array_set_size(samples, 0);
+
+        if (i + 1 == warmup) {
+            memcpy(baseline, live_objects, sizeof(baseline));
+            baseline_rss = read_rss();
+        }
+
+        if ((soak_cycles >= 10) && ((i + 1) % (soak_cycles / 10) == 0)) {
+            printf("soak: %u cycles, rss %ld KiB, %u errors\n", i + 1, read_rss() / 1024, errors);
+            fflush(stdout);
+        }
+    }
+
+    for (guint type = 0; type < LIVE_COUNT; type++) {
+        printf("soak: %-20s %8u live, %8u after warm-up, %12" G_GUINT64_FORMAT " allocated\n",
+            live_names[type],
+            live_objects[type],
+            baseline[type],
+            allocated_objects[type]);
+        grown |= (live_objects[type] > baseline[type]);
+    }
+
+    glong rss = read_rss();
+    printf("soak: rss %ld KiB, %ld KiB after warm-up\n", rss / 1024, baseline_rss / 1024);
+
+    g_array_free(samples, TRUE);
+    delete_accounts(accounts);
+
+    if (grown)
+        fail("live objects grew during the soak test");
+    if ((baseline_rss > 0) && (rss - baseline_rss > SOAK_RSS_SLACK))
+        fail("RSS grew during the soak test");
+    if (errors > 0)
+        fail("keyring calls failed during the soak test");
+}
+
+int main(int argc, char** argv)
+{
+    GError* error = NULL;
+    GList* sizes = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-i") == 0) && (i + 1 < argc))
+            bench_iterations = MAX(atoi(argv[++i]), 1);
+        else if ((strcmp(argv[i], "-w") == 0) && (i + 1 < argc))
+            bench_window = MAX(atoi(argv[++i]), 1);
+        else if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc))
+            soak_cycles = MAX(atoi(argv[++i]), 1);
+        else if (atoi(argv[i]) > 0)
+            sizes = g_list_append(sizes, GINT_TO_POINTER(atoi(argv[i])));
+        else
+            fail("usage: purple-gnome-keyring-bench [-i iterations] [-w window] [accounts ...] | -s cycles [accounts]");
+    }
+
+    if ((sizes == NULL) && (soak_cycles > 0)) {
+        sizes = g_list_append(sizes, GINT_TO_POINTER(1));
+    } else if (sizes == NULL) {
+        sizes = g_list_append(sizes, GINT_TO_POINTER(10));
+        sizes = g_list_append(sizes, GINT_TO_POINTER(100));
+        sizes = g_list_append(sizes, GINT_TO_POINTER(1000));
+    }
+
+    // Headless libpurple with a throwaway config dir
+    gchar* user_dir = g_dir_make_tmp("purple-gnome-keyring-bench-XXXXXX", &error);
+    if (user_dir == NULL)
+        fail(error->message);
+
+    purple_util_set_user_dir(user_dir);
+    purple_debug_set_enabled(g_getenv("BENCH_DEBUG") != NULL);
+    purple_eventloop_set_ui_ops(&headless_eventloop_ops);
+
+    if (!purple_core_init(BENCH_UI))
+        fail("could not initialize libpurple");
+
+    GDBusConnection* bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    if (bus == NULL)
+        fail(error->message);
+    g_dbus_connection_add_filter(bus, count_dbus_calls, NULL, NULL);
+
+    bench_plugin = g_new0(PurplePlugin, 1);
+    init_plugin(bench_plugin);
+    purple_prefs_set_int(KEYRING_PLUG_STATUS_PREF, LOADED);
+    purple_prefs_set_bool(KEYRING_CACHE_PREF, FALSE);
+    purple_prefs_set_int(KEYRING_BULK_WINDOW_PREF, bench_window);
+
+    plugin_load(bench_plugin);
+    if (!run_until(is_startup_done))
+        fail("no Secret Service collection available");
+    drain();
+
+    if (soak_cycles > 0) {
+        // Eager init keeps the proxies of all items, searches return them again
+        for (gint lazy = TRUE; lazy >= FALSE; lazy--) {
+            plugin_unload(bench_plugin);
+            drain();
+            purple_prefs_set_bool(KEYRING_LAZY_INIT_PREF, lazy);
+            plugin_load(bench_plugin);
+            if (!run_until(is_startup_done))
+                fail("no Secret Service collection available");
+            drain();
+
+            soak_accounts(GPOINTER_TO_INT(sizes->data), lazy);
+        }
+    } else {
+        printf("%-20s %8s %8s %12s %12s %10s %8s\n", "scenario", "accounts", "samples", "p50 [ms]", "p99 [ms]", "dbus calls", "errors");
+        for (GList* li = sizes; li != NULL; li = li->next)
+            bench_accounts(GPOINTER_TO_INT(li->data));
+    }
+
+    plugin_unload(bench_plugin);
+    drain();
+
+    g_list_free(sizes);
+    g_object_unref(bus);
+    g_free(user_dir);
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Run a keyring program on a private session bus with a stand-in Secret Service.
+#
+# By default an isolated gnome-keyring-daemon with an empty-password login
+# keyring is started. Set BENCH_SERVICE to a command that provides
+# org.freedesktop.secrets on the session bus to use a mock service instead.
+# If BENCH_OUTPUT is set, the output of the program is also written to that
+# file. The exit status is the one of the program.
+#
+# Usage: run-bench.sh <program> [args ...]
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <program> [args ...]" >&2
+    exit 2
+fi
+
+if [ -z "$BENCH_SESSION" ]; then
+    command -v dbus-run-session >/dev/null || { echo "dbus-run-session not found" >&2; exit 1; }
+
+    BENCH_HOME=$(mktemp -d "${TMPDIR:-/tmp}/purple-gnome-keyring-bench.XXXXXX")
+    trap 'rm -rf "$BENCH_HOME"' EXIT INT TERM
+
+    mkdir -m 700 "$BENCH_HOME/runtime"
+    HOME="$BENCH_HOME" \
+    XDG_RUNTIME_DIR="$BENCH_HOME/runtime" \
+    XDG_DATA_HOME="$BENCH_HOME/data" \
+    XDG_CONFIG_HOME="$BENCH_HOME/config" \
+    BENCH_SESSION=1 \
+        dbus-run-session -- "$0" "$@"
+    exit $?
+fi
+
+# Inside the private session bus
+if [ -n "$BENCH_SERVICE" ]; then
+    sh -c "$BENCH_SERVICE" &
+    SERVICE_PID=$!
+    trap 'kill $SERVICE_PID 2>/dev/null || :' EXIT INT TERM
+    sleep 1
+else
+    command -v gnome-keyring-daemon >/dev/null || { echo "gnome-keyring-daemon not found, set BENCH_SERVICE" >&2; exit 1; }
+    printf '' | gnome-keyring-daemon --unlock --components=secrets >/dev/null
+fi
+
+if [ -n "$BENCH_OUTPUT" ]; then
+    status=0
+    "$@" >"$BENCH_OUTPUT" || status=$?
+    cat "$BENCH_OUTPUT"
+    exit $status
+fi
+
+"$@"
@@ -0,0 +1,821 @@
+/*
+ * Command-line tool to move passwords between purple accounts.xml files and
+ * the keyring, without starting a messenger.
+ *
+ * The plugin source is included directly, like in the benchmark, so passwords
+ * are stored and deleted with the schema and pipelines of the plugin. The tool
+ * runs on a throwaway libpurple profile: the given accounts.xml files are only
+ * read, and rewritten with -s.
+ *
+ * Usage: purple-gnome-keyring-cli [-k keyring] [-w window] [-v] import [-s] accounts.xml ...
+ *        purple-gnome-keyring-cli [-k keyring] [-w window] [-v] remove accounts.xml ...
+ *        purple-gnome-keyring-cli [-k keyring] [-v] export [-o file]
+ *
+ * import stores the passwords of all accounts of the files in the keyring,
+ * -s removes the stored passwords from the files afterwards. remove deletes the
+ * passwords of the accounts from the keyring. export writes all passwords in
+ * the keyring as accounts.xml (to stdout by default), which can be imported again.
+ */
+
+#include "../purple-gnome-keyring.c"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+
+#include "../headless.h"
+
+#define CLI_UI "purple-gnome-keyring-cli"
+#define CLI_TIMEOUT 60 // seconds to wait for the keyring to show up
+#define CLI_CHUNK 65536 // bytes of accounts.xml parsed at a time
+#define CLI_READ_AHEAD 4 // parsed accounts kept queued per call in flight
+
+// Vars
+static PurplePlugin* cli_plugin = NULL;
+static gboolean cli_strip = FALSE;
+
+static void fail(const gchar* msg)
+{
+    fprintf(stderr, "purple-gnome-keyring-cli: %s\n", msg);
+    exit(1);
+}
+
+static void usage(void)
+{
+    fail("usage: purple-gnome-keyring-cli [-k keyring] [-w window] [-v] import [-s] | remove accounts.xml ... | export [-o file]");
+}
+
+// Free a string that may hold a password
+static void clear_secret(gchar** secret)
+{
+    if (*secret == NULL)
+        return;
+
+    memset(*secret, 0, strlen(*secret));
+    g_free(*secret);
+    *secret = NULL;
+}
+
+static void report(const gchar* action, guint done, guint failed, gint64 elapsed, const gchar* extra)
+{
+    gdouble seconds = elapsed / (gdouble)G_USEC_PER_SEC;
+
+    fprintf(stderr, "%s %u passwords in %.3f s (%.1f per second), %u failed%s\n",
+        action,
+        done,
+        seconds,
+        (seconds > 0) ? done / seconds : 0,
+        failed,
+        (extra != NULL) ? extra : "");
+}
+
+/**************************************************
+ **************************************************
+ ***************** Accounts files *****************
+ **************************************************
+ **************************************************/
+
+// An accounts.xml being read, finished once all of its accounts are done
+typedef struct {
+    gchar* path;
+    GArray* stored; // gboolean per <password> element of the file, TRUE once it is in the keyring
+    guint pending; // accounts parsed but not done yet
+    gboolean parsed;
+    gboolean broken; // could not be parsed completely, left as it is
+} CliFile;
+
+typedef struct {
+    CliFile* file;
+    gchar* protocol;
+    gchar* name;
+    gchar* password;
+    gint password_index; // of its <password> element in the file, -1 if none
+    PurpleAccount* account; // created when its call is started
+    gboolean failed;
+    gboolean skipped; // the pipeline wrote nothing, e.g. the password was unchanged
+} CliEntry;
+
+// Import or remove run, the files are read while the calls of the accounts before run
+typedef struct {
+    const gchar* action;
+    void (*start)(PipelineCall* call);
+    gboolean need_password;
+
+    gchar** paths; // files not opened yet
+    FILE* input;
+    CliFile* file;
+    GMarkupParseContext* parser;
+
+    // Parser state of the current file
+    guint depth;
+    gboolean in_account;
+    gchar* field; // account element whose text is collected
+    GString* text;
+    gchar* protocol;
+    gchar* name;
+    gchar* password;
+    gint password_index;
+    guint passwords; // <password> elements of the file so far, including the ones of proxies
+
+    GQueue queued; // parsed, not started yet
+    GQueue finished; // done, cleaned up by the run loop
+    guint window;
+    guint in_flight;
+    guint succeeded;
+    guint failed;
+    guint skipped; // accounts without password
+    guint unwritten; // calls the pipeline skipped
+    guint files;
+    guint broken_files;
+} CliRun;
+
+static CliRun* cli_run = NULL;
+
+static void free_cli_entry(CliEntry* entry)
+{
+    g_free(entry->protocol);
+    g_free(entry->name);
+    clear_secret(&entry->password);
+    g_free(entry);
+}
+
+static void reset_parser_state(CliRun* run)
+{
+    run->depth = 0;
+    run->in_account = FALSE;
+    run->password_index = -1;
+    run->passwords = 0;
+    g_clear_pointer(&run->field, g_free);
+    g_clear_pointer(&run->protocol, g_free);
+    g_clear_pointer(&run->name, g_free);
+    clear_secret(&run->password);
+    if (run->text->len > 0)
+        memset(run->text->str, 0, run->text->len);
+    g_string_truncate(run->text, 0);
+}
+
+// Queue the account whose element just ended
+static void queue_parsed_account(CliRun* run)
+{
+    if ((run->protocol == NULL) || (run->name == NULL) || (*run->protocol == '\0') || (*run->name == '\0'))
+        return;
+
+    if (run->need_password && ((run->password == NULL) || (*run->password == '\0'))) {
+        run->skipped++;
+        return;
+    }
+
+    CliEntry* entry = g_new0(CliEntry, 1);
+
+    entry->file = run->file;
+    entry->protocol = g_strdup(run->protocol);
+    entry->name = g_strdup(run->name);
+    entry->password = g_strdup(run->password);
+    entry->password_index = run->password_index;
+    run->file->pending++;
+
+    g_queue_push_tail(&run->queued, entry);
+}
+
+/*
+ * accounts.xml is <account version='1.0'> with one <account> per account, only
+ * <protocol>, <name> and <password> of the account itself are used. Every
+ * <password> element is counted, so the ones to strip can be found again in the file.
+ */
+static void on_element_start(GMarkupParseContext* context,
+    const gchar* element_name,
+    const gchar** attribute_names,
+    const gchar** attribute_values,
+    gpointer user_data,
+    GError** error)
+{
+    CliRun* run = (CliRun*)user_data;
+
+    run->depth++;
+
+    if (strcmp(element_name, "password") == 0) {
+        if (run->in_account && (run->depth == 3))
+            run->password_index = run->passwords;
+        run->passwords++;
+        g_array_set_size(run->file->stored, run->passwords);
+    }
+
+    if ((run->depth == 2) && (strcmp(element_name, "account") == 0)) {
+        run->in_account = TRUE;
+        run->password_index = -1;
+        g_clear_pointer(&run->protocol, g_free);
+        g_clear_pointer(&run->name, g_free);
+        clear_secret(&run->password);
+    } else if (run->in_account && (run->depth == 3)
+        && ((strcmp(element_name, "protocol") == 0) || (strcmp(element_name, "name") == 0) || (strcmp(element_name, "password") == 0))) {
+        run->field = g_strdup(element_name);
+        g_string_truncate(run->text, 0);
+    }
+}
+
+static void on_element_end(GMarkupParseContext* context,
+    const gchar* element_name,
+    gpointer user_data,
+    GError** error)
+{
+    CliRun* run = (CliRun*)user_data;
+
+    if ((run->field != NULL) && (run->depth == 3)) {
+        gchar* value = g_strdup(run->text->str);
+
+        if (strcmp(run->field, "protocol") == 0) {
+            g_free(run->protocol);
+            run->protocol = value;
+        } else if (strcmp(run->field, "name") == 0) {
+            g_free(run->name);
+            run->name = value;
+        } else {
+            clear_secret(&run->password);
+            run->password = value;
+        }
+
+        memset(run->text->str, 0, run->text->len);
+        g_string_truncate(run->text, 0);
+        g_clear_pointer(&run->field, g_free);
+    } else if (run->in_account && (run->depth == 2)) {
+        queue_parsed_account(run);
+        run->in_account = FALSE;
+    }
+
+    run->depth--;
+}
+
+static void on_element_text(GMarkupParseContext* context,
+    const gchar* text,
+    gsize text_len,
+    gpointer user_data,
+    GError** error)
+{
+    CliRun* run = (CliRun*)user_data;
+
+    if (run->field != NULL)
+        g_string_append_len(run->text, text, text_len);
+}
+
+static const GMarkupParser accounts_parser = {
+    on_element_start,
+    on_element_end,
+    on_element_text,
+    NULL,
+    NULL
+};
+
+// Next <password> or <password/> tag
+static const gchar* find_password_tag(const gchar* pos)
+{
+    while ((pos = strstr(pos, "<password")) != NULL) {
+        gchar next = pos[strlen("<password")];
+
+        if ((next == '>') || (next == '/') || g_ascii_isspace(next))
+            return pos;
+        pos++;
+    }
+
+    return NULL;
+}
+
+// Rewrite the file without the <password> elements of the accounts stored in the keyring
+static void strip_passwords(CliFile* file)
+{
+    gchar* contents = NULL;
+    gsize length = 0;
+    GError* error = NULL;
+    GStatBuf st;
+    guint stripped = 0;
+    guint index = 0;
+
+    if (!g_file_get_contents(file->path, &contents, &length, &error)) {
+        fprintf(stderr, "%s: %s\n", file->path, error->message);
+        g_error_free(error);
+        return;
+    }
+
+    GString* out = g_string_sized_new(length);
+    const gchar* pos = contents;
+    const gchar* tag = NULL;
+
+    while ((tag = find_password_tag(pos)) != NULL) {
+        const gchar* close = strchr(tag, '>');
+        const gchar* end = NULL;
+
+        if (close == NULL)
+            break;
+
+        if (close[-1] == '/') {
+            end = close + 1;
+        } else if ((end = strstr(close, "</password>")) != NULL) {
+            end += strlen("</password>");
+        } else {
+            break;
+        }
+
+        if ((index < file->stored->len) && g_array_index(file->stored, gboolean, index)) {
+            const gchar* start = tag;
+
+            // Drop the line of the element if it has one of its own
+            while ((start > pos) && ((start[-1] == ' ') || (start[-1] == '\t')))
+                start--;
+            if (((start == contents) || (start[-1] == '\n')) && (*end == '\n'))
+                end++;
+            else
+                start = tag;
+
+            g_string_append_len(out, pos, start - pos);
+            stripped++;
+        } else {
+            g_string_append_len(out, pos, end - pos);
+        }
+
+        pos = end;
+        index++;
+    }
+    g_string_append(out, pos);
+
+    if (index != file->stored->len) {
+        fprintf(stderr, "%s: changed while reading, passwords are not removed\n", file->path);
+    } else if (stripped > 0) {
+        // Created with the permissions of the old file, it may still hold passwords of failed accounts
+        int mode = (g_stat(file->path, &st) == 0) ? (st.st_mode & 0777) : 0600;
+
+        if (!g_file_set_contents_full(file->path, out->str, out->len, G_FILE_SET_CONTENTS_CONSISTENT, mode, &error)) {
+            fprintf(stderr, "%s: %s\n", file->path, error->message);
+            g_error_free(error);
+        } else {
+            printf("%s: removed %u passwords\n", file->path, stripped);
+        }
+    }
+
+    memset(contents, 0, length);
+    memset(out->str, 0, out->len);
+    g_string_free(out, TRUE);
+    g_free(contents);
+}
+
+static void finish_cli_file(CliFile* file)
+{
+    if (cli_strip && !file->broken)
+        strip_passwords(file);
+
+    g_array_free(file->stored, TRUE);
+    g_free(file->path);
+    g_free(file);
+}
+
+static void close_cli_file(CliRun* run, GError* error)
+{
+    CliFile* file = run->file;
+
+    if (error != NULL) {
+        fprintf(stderr, "%s: %s\n", file->path, error->message);
+        file->broken = TRUE;
+        run->broken_files++;
+        g_error_free(error);
+    }
+
+    fclose(run->input);
+    g_markup_parse_context_free(run->parser);
+    reset_parser_state(run);
+    run->input = NULL;
+    run->parser = NULL;
+    run->file = NULL;
+
+    file->parsed = TRUE;
+    if (file->pending == 0)
+        finish_cli_file(file);
+}
+
+static void open_cli_file(CliRun* run, const gchar* path)
+{
+    FILE* input = g_fopen(path, "rb");
+
+    if (input == NULL) {
+        fprintf(stderr, "%s: %s\n", path, g_strerror(errno));
+        run->broken_files++;
+        return;
+    }
+
+    CliFile* file = g_new0(CliFile, 1);
+    file->path = g_strdup(path);
+    file->stored = g_array_new(FALSE, TRUE, sizeof(gboolean));
+
+    run->files++;
+    run->input = input;
+    run->file = file;
+    run->parser = g_markup_parse_context_new(&accounts_parser, 0, run, NULL);
+    reset_parser_state(run);
+}
+
+// Parse the next chunk of the current file or open the next one, FALSE once all files are read
+static gboolean read_accounts(CliRun* run)
+{
+    gchar buffer[CLI_CHUNK];
+    GError* error = NULL;
+
+    if (run->input == NULL) {
+        if (*run->paths == NULL)
+            return FALSE;
+        open_cli_file(run, *run->paths++);
+        return TRUE;
+    }
+
+    gsize length = fread(buffer, 1, sizeof(buffer), run->input);
+
+    if (length > 0) {
+        if (!g_markup_parse_context_parse(run->parser, buffer, length, &error))
+            close_cli_file(run, error);
+    } else if (ferror(run->input)) {
+        close_cli_file(run, g_error_new_literal(G_FILE_ERROR, g_file_error_from_errno(errno), g_strerror(errno)));
+    } else {
+        g_markup_parse_context_end_parse(run->parser, &error);
+        close_cli_file(run, error);
+    }
+
+    memset(buffer, 0, length);
+    return TRUE;
+}
+
+/**************************************************
+ **************************************************
+ ***************** Import / remove ****************
+ **************************************************
+ **************************************************/
+
+static void on_cli_call_done(PurpleAccount* account, const GError* error, gboolean skipped, gpointer user_data)
+{
+    CliEntry* entry = (CliEntry*)user_data;
+
+    cli_run->in_flight--;
+
+    if (error != NULL) {
+        entry->failed = TRUE;
+        cli_run->failed++;
+        fprintf(stderr, "%s (%s): %s\n", entry->name, entry->protocol, error->message);
+    } else if (skipped) {
+        // Not written now, so its password is not known to be in the keyring
+        entry->skipped = TRUE;
+        cli_run->unwritten++;
+    } else {
+        cli_run->succeeded++;
+    }
+
+    // The pipeline is not done with the account yet
+    g_queue_push_tail(&cli_run->finished, entry);
+}
+
+static gboolean start_cli_entry(CliRun* run, CliEntry* entry)
+{
+    // purple_account_new() would hand out the account of a running call with the same username
+    if (purple_accounts_find(entry->name, entry->protocol) != NULL)
+        return FALSE;
+
+    // Never remembered, so the password is not written to the throwaway profile
+    entry->account = purple_account_new(entry->name, entry->protocol);
+    purple_account_set_remember_password(entry->account, FALSE);
+    purple_account_set_password(entry->account, entry->password);
+    purple_accounts_add(entry->account);
+
+    run->in_flight++;
+    run->start(pipeline_call_new(entry->account, NULL, on_cli_call_done, entry));
+
+    return TRUE;
+}
+
+static void reap_cli_entries(CliRun* run)
+{
+    CliEntry* entry = NULL;
+
+    while ((entry = g_queue_pop_head(&run->finished)) != NULL) {
+        CliFile* file = entry->file;
+
+        if (!entry->failed && !entry->skipped && (entry->password_index >= 0))
+            g_array_index(file->stored, gboolean, entry->password_index) = TRUE;
+
+        release_account_context(entry->account);
+        purple_accounts_remove(entry->account);
+        purple_account_destroy(entry->account);
+
+        file->pending--;
+        if (file->parsed && (file->pending == 0))
+            finish_cli_file(file);
+
+        free_cli_entry(entry);
+    }
+
+    // The throwaway profile has no use for the item path index, it would only grow with every account
+    if (g_hash_table_size(item_paths) > run->window)
+        g_hash_table_remove_all(item_paths);
+}
+
+// Windowed run over all accounts of the files, the files are read as the window drains
+static gboolean run_accounts(const gchar* action, void (*start)(PipelineCall* call), gboolean need_password, gchar** paths)
+{
+    CliRun run = { 0 };
+    CliEntry* entry = NULL;
+    gint64 started = g_get_monotonic_time();
+
+    run.action = action;
+    run.start = start;
+    run.need_password = need_password;
+    run.paths = paths;
+    run.text = g_string_new(NULL);
+    run.window = MAX(purple_prefs_get_int(KEYRING_BULK_WINDOW_PREF), 1);
+    g_queue_init(&run.queued);
+    g_queue_init(&run.finished);
+    cli_run = &run;
+
+    for (;;) {
+        reap_cli_entries(&run);
+
+        while ((run.in_flight < run.window) && ((entry = g_queue_pop_head(&run.queued)) != NULL)) {
+            if (!start_cli_entry(&run, entry)) {
+                g_queue_push_head(&run.queued, entry);
+                break;
+            }
+        }
+
+        // Synchronous completions
+        if (!g_queue_is_empty(&run.finished))
+            continue;
+
+        if ((g_queue_get_length(&run.queued) < run.window * CLI_READ_AHEAD) && read_accounts(&run))
+            continue;
+
+        if ((run.in_flight == 0) && g_queue_is_empty(&run.queued))
+            break;
+
+        g_main_context_iteration(NULL, TRUE);
+    }
+
+    gchar* extra = g_strdup_printf(", %u files", run.files);
+    if (run.skipped > 0) {
+        gchar* tmp = extra;
+        extra = g_strdup_printf("%s, %u accounts without password", tmp, run.skipped);
+        g_free(tmp);
+    }
+    if (run.unwritten > 0) {
+        gchar* tmp = extra;
+        extra = g_strdup_printf("%s, %u skipped", tmp, run.unwritten);
+        g_free(tmp);
+    }
+    if (run.broken_files > 0) {
+        gchar* tmp = extra;
+        extra = g_strdup_printf("%s, %u files could not be read", tmp, run.broken_files);
+        g_free(tmp);
+    }
+    report(action, run.succeeded, run.failed, g_get_monotonic_time() - started, extra);
+
+    g_free(extra);
+    g_string_free(run.text, TRUE);
+    cli_run = NULL;
+
+    return (run.failed == 0) && (run.broken_files == 0);
+}
+
+/**************************************************
+ **************************************************
+ ********************* Export *********************
+ **************************************************
+ **************************************************/
+
+typedef struct {
+    FILE* output;
+    guint exported;
+    guint failed;
+    gboolean done;
+} CliExport;
+
+static void on_export_items_loaded(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    CliExport* export = (CliExport*)user_data;
+    GError* error = NULL;
+    GList* items = secret_collection_search_finish(plugin_collection, result, &error);
+    track_items(items);
+
+    export->done = TRUE;
+
+    if (error != NULL) {
+        record_operation_error(OP_SEARCH);
+        fprintf(stderr, "Could not list the keyring: %s\n", error->message);
+        export->failed++;
+        g_error_free(error);
+        return;
+    }
+
+    for (GList* li = items; li != NULL; li = li->next) {
+        GHashTable* attributes = secret_item_get_attributes(li->data);
+        SecretValue* value = secret_item_get_secret(li->data);
+        const gchar* protocol = g_hash_table_lookup(attributes, "protocol");
+        const gchar* username = g_hash_table_lookup(attributes, "username");
+        const gchar* password = (value != NULL) ? secret_value_get_text(value) : NULL;
+
+        if ((protocol == NULL) || (username == NULL) || (password == NULL)) {
+            fprintf(stderr, "%s: no password\n", g_dbus_proxy_get_object_path(G_DBUS_PROXY(li->data)));
+            export->failed++;
+        } else {
+            gchar* xml = g_markup_printf_escaped("\t<account>\n\t\t<protocol>%s</protocol>\n\t\t<name>%s</name>\n\t\t<password>%s</password>\n\t</account>\n",
+                protocol,
+                username,
+                password);
+
+            fputs(xml, export->output);
+            clear_secret(&xml);
+            export->exported++;
+        }
+
+        if (value != NULL)
+            secret_value_unref(value);
+        g_hash_table_unref(attributes);
+    }
+
+    g_list_free_full(items, g_object_unref);
+}
+
+// Write all passwords of the keyring as accounts.xml, to stdout if path is NULL
+static gboolean export_accounts(const gchar* path)
+{
+    CliExport export = { stdout, 0, 0, FALSE };
+    gint64 started = g_get_monotonic_time();
+
+    if (path != NULL) {
+        // Only readable by the user, like accounts.xml
+        gint fd = g_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+        if ((fd < 0) || ((export.output = fdopen(fd, "w")) == NULL)) {
+            fprintf(stderr, "%s: %s\n", path, g_strerror(errno));
+            return FALSE;
+        }
+    }
+
+    fputs("<?xml version='1.0' encoding='UTF-8' ?>\n\n<account version='1.0'>\n", export.output);
+
+    GHashTable* attributes = secret_attributes_build(PURPLE_SCHEMA, "version", KEYRING_SCHEMA_VERSION, NULL);
+    TimedCall* timed = timed_call_new(OP_SEARCH, NULL, on_export_items_loaded, &export, NULL);
+
+    keyring_search(timed, plugin_collection, attributes, SECRET_SEARCH_ALL | SECRET_SEARCH_UNLOCK | SECRET_SEARCH_LOAD_SECRETS);
+    g_hash_table_unref(attributes);
+
+    while (!export.done)
+        g_main_context_iteration(NULL, TRUE);
+
+    fputs("</account>\n", export.output);
+    if (path != NULL)
+        fclose(export.output);
+    else
+        fflush(stdout);
+
+    report("Exported", export.exported, export.failed, g_get_monotonic_time() - started, NULL);
+
+    return export.failed == 0;
+}
+
+/**************************************************
+ **************************************************
+ ********************** Main **********************
+ **************************************************
+ **************************************************/
+
+static gboolean wake_up(gpointer data)
+{
+    return TRUE;
+}
+
+// Wait until the keyring is resolved and unlocked, an unlock prompt may take as long as it needs
+static gboolean open_keyring(void)
+{
+    gint64 deadline = g_get_monotonic_time() + (gint64)CLI_TIMEOUT * G_USEC_PER_SEC;
+    guint timer = g_timeout_add_seconds(1, wake_up, NULL);
+
+    while ((plugin_state != COLLECTION_READY) || schema_migrating) {
+        if (plugin_state == COLLECTION_LOCKED)
+            request_unlock();
+        else if ((plugin_state == COLLECTION_PENDING) && (g_get_monotonic_time() > deadline))
+            break;
+
+        g_main_context_iteration(NULL, TRUE);
+    }
+
+    g_source_remove(timer);
+    return plugin_state == COLLECTION_READY;
+}
+
+// Remove the throwaway profile
+static void remove_user_dir(const gchar* user_dir)
+{
+    GDir* dir = g_dir_open(user_dir, 0, NULL);
+    const gchar* name = NULL;
+
+    if (dir == NULL)
+        return;
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        gchar* path = g_build_filename(user_dir, name, NULL);
+        g_remove(path);
+        g_free(path);
+    }
+
+    g_dir_close(dir);
+    g_rmdir(user_dir);
+}
+
+int main(int argc, char** argv)
+{
+    GError* error = NULL;
+    const gchar* keyring = NULL;
+    const gchar* output = NULL;
+    gint window = KEYRING_BULK_WINDOW_DEFAULT;
+    gboolean verbose = FALSE;
+    gboolean success = FALSE;
+    int i = 1;
+
+    for (; (i < argc) && (argv[i][0] == '-'); i++) {
+        if ((strcmp(argv[i], "-k") == 0) && (i + 1 < argc))
+            keyring = argv[++i];
+        else if ((strcmp(argv[i], "-w") == 0) && (i + 1 < argc))
+            window = MAX(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "-v") == 0)
+            verbose = TRUE;
+        else
+            usage();
+    }
+
+    if (i >= argc)
+        usage();
+
+    const gchar* command = argv[i++];
+
+    if (strcmp(command, "import") == 0) {
+        if ((i < argc) && (strcmp(argv[i], "-s") == 0)) {
+            cli_strip = TRUE;
+            i++;
+        }
+        if (i >= argc)
+            usage();
+    } else if (strcmp(command, "remove") == 0) {
+        if (i >= argc)
+            usage();
+    } else if (strcmp(command, "export") == 0) {
+        if ((i + 1 < argc) && (strcmp(argv[i], "-o") == 0)) {
+            output = argv[i + 1];
+            i += 2;
+        }
+        if (i < argc)
+            usage();
+    } else {
+        usage();
+    }
+
+    // Headless libpurple with a throwaway config dir, the accounts of the user are not loaded
+    gchar* user_dir = g_dir_make_tmp("purple-gnome-keyring-cli-XXXXXX", &error);
+    if (user_dir == NULL)
+        fail(error->message);
+
+    purple_util_set_user_dir(user_dir);
+    purple_debug_set_enabled(verbose);
+    purple_eventloop_set_ui_ops(&headless_eventloop_ops);
+
+    if (!purple_core_init(CLI_UI))
+        fail("could not initialize libpurple");
+
+    cli_plugin = g_new0(PurplePlugin, 1);
+    init_plugin(cli_plugin);
+    purple_prefs_set_int(KEYRING_PLUG_STATUS_PREF, LOADED);
+    purple_prefs_set_bool(KEYRING_CACHE_PREF, FALSE);
+    purple_prefs_set_int(KEYRING_BULK_WINDOW_PREF, window);
+    // The accounts of the tool only live for their keyring call, no stores or deletes on account signals
+    purple_prefs_set_bool(KEYRING_AUTO_SAVE_PREF, FALSE);
+    // Items are written with the current schema, old items are migrated by the plugin
+    schema_migration = FALSE;
+    // Listing a large keyring may take a while
+    purple_prefs_set_int(operation_deadline_prefs[OP_SEARCH], 0);
+
+    if (keyring != NULL) {
+        purple_prefs_set_bool(KEYRING_CUSTOM_NAME_PREF, TRUE);
+        purple_prefs_set_string(KEYRING_NAME_PREF, keyring);
+    }
+
+    plugin_load(cli_plugin);
+    if (!open_keyring())
+        fail("no keyring available, is the Gnome Keyring running?");
+
+    if (strcmp(command, "import") == 0)
+        success = run_accounts("Imported", bulk_store_account_password, TRUE, argv + i);
+    else if (strcmp(command, "remove") == 0)
+        success = run_accounts("Removed", start_delete_call, FALSE, argv + i);
+    else
+        success = export_accounts(output);
+
+    plugin_unload(cli_plugin);
+    purple_core_quit();
+    remove_user_dir(user_dir);
+    g_free(user_dir);
+
+    return success ? 0 : 1;
+}
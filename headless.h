@@ -0,0 +1,65 @@
+/*
+ * libpurple glib event loop for programs that drive the plugin without a
+ * messenger (benchmark, command-line tool), as in the nullclient example.
+ *
+ * Include after purple-gnome-keyring.c and pass headless_eventloop_ops to
+ * purple_eventloop_set_ui_ops() before purple_core_init().
+ */
+
+#ifndef PURPLE_GNOME_KEYRING_HEADLESS_H
+#define PURPLE_GNOME_KEYRING_HEADLESS_H
+
+#include "eventloop.h"
+
+typedef struct {
+    PurpleInputFunction function;
+    gpointer data;
+} HeadlessIOClosure;
+
+static gboolean headless_io_invoke(GIOChannel* source, GIOCondition condition, gpointer data)
+{
+    HeadlessIOClosure* closure = data;
+    PurpleInputCondition purple_cond = 0;
+
+    if (condition & (G_IO_IN | G_IO_HUP | G_IO_ERR))
+        purple_cond |= PURPLE_INPUT_READ;
+    if (condition & (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+        purple_cond |= PURPLE_INPUT_WRITE;
+
+    closure->function(closure->data, g_io_channel_unix_get_fd(source), purple_cond);
+    return TRUE;
+}
+
+static guint headless_input_add(gint fd, PurpleInputCondition condition, PurpleInputFunction function, gpointer data)
+{
+    HeadlessIOClosure* closure = g_new0(HeadlessIOClosure, 1);
+    GIOCondition cond = 0;
+
+    closure->function = function;
+    closure->data = data;
+
+    if (condition & PURPLE_INPUT_READ)
+        cond |= G_IO_IN | G_IO_HUP | G_IO_ERR;
+    if (condition & PURPLE_INPUT_WRITE)
+        cond |= G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+
+    GIOChannel* channel = g_io_channel_unix_new(fd);
+    guint id = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond, headless_io_invoke, closure, g_free);
+    g_io_channel_unref(channel);
+
+    return id;
+}
+
+static PurpleEventLoopUiOps headless_eventloop_ops = {
+    g_timeout_add,
+    g_source_remove,
+    headless_input_add,
+    g_source_remove,
+    NULL,
+    g_timeout_add_seconds,
+    NULL,
+    NULL,
+    NULL
+};
+
+#endif
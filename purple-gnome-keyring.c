@@ -17,13 +17,25 @@
 #define PURPLE_PLUGINS
 #endif
 
+// Needed for the D-Bus path based secret functions
+#ifndef SECRET_WITH_UNSTABLE
+#define SECRET_WITH_UNSTABLE 1
+#define SECRET_API_SUBJECT_TO_CHANGE 1
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <gcrypt.h>
+#include <glib/gstdio.h>
 #include <libsecret/secret.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "account.h"
 #include "connection.h"
 #include "core.h"
 #include "debug.h"
+#include "network.h"
 #include "notify.h"
 #include "plugin.h"
 #include "request.h"
@@ -40,6 +52,17 @@ typedef enum { ENABLED = 0,
     STORING = 5,
     LOADING = 6 } status_type;
 
+// Whether pipeline calls can use plugin_collection right now
+typedef enum {
+    COLLECTION_PENDING = 0, // service or collection not resolved (yet), calls wait
+    COLLECTION_LOCKED = 1, // calls wait, the first one starts the unlock
+    COLLECTION_UNLOCKING = 2, // calls wait for the running unlock
+    COLLECTION_READY = 3 } collection_state;
+
+// Where passwords are stored
+typedef enum { BACKEND_KEYRING = 0,
+    BACKEND_VAULT = 1 } backend_type;
+
 /* Preferences */
 #define PLUGIN_ID "core-grburst-purple_gnome_keyring"
 #define KEYRING_PLUG_STATUS_PREF "/plugins/core/purple_gnome_keyring/plug_status"
@@ -48,10 +71,59 @@ typedef enum { ENABLED = 0,
 #define KEYRING_CUSTOM_NAME_DEFAULT FALSE
 #define KEYRING_NAME_PREF "/plugins/core/purple_gnome_keyring/custom_keyring/keyring_name"
 #define KEYRING_NAME_DEFAULT ""
+#define KEYRING_COLLECTION_PATH_PREF "/plugins/core/purple_gnome_keyring/custom_keyring/collection_path"
+#define KEYRING_COLLECTION_PATH_DEFAULT ""
+#define KEYRING_RESOLVE_DELAY 2000 // ms after the last keyring name change
 #define KEYRING_AUTO_SAVE_PREF "/plugins/core/purple_gnome_keyring/auto_save"
 #define KEYRING_AUTO_SAVE_DEFAULT TRUE
 #define KEYRING_AUTO_LOCK_PREF "/plugins/core/purple_gnome_keyring/auto_lock"
 #define KEYRING_AUTO_LOCK_DEFAULT FALSE
+#define KEYRING_LAZY_INIT_PREF "/plugins/core/purple_gnome_keyring/lazy_init"
+#define KEYRING_LAZY_INIT_DEFAULT TRUE
+#define KEYRING_SCHEMA_VERSION 2 // of the items written, version 1 items have no version attribute
+#define KEYRING_SWEEP_PREF "/plugins/core/purple_gnome_keyring/sweep"
+#define KEYRING_SWEEP_DEFAULT FALSE
+#define KEYRING_SWEEP_DELAY 60 // s after startup, to stay out of the way of the init loads
+#define KEYRING_CONNECT_FIRST_PREF "/plugins/core/purple_gnome_keyring/connect_first" // index keys of accounts loaded first
+#define KEYRING_RECENT_PREF "/plugins/core/purple_gnome_keyring/recent_accounts" // index keys, last signed on first
+#define KEYRING_RECENT_MAX 32
+#define KEYRING_PRIORITY_RECENT 3 // most recently used accounts loaded ahead of the others
+#define KEYRING_ON_DEMAND_PREF "/plugins/core/purple_gnome_keyring/on_demand"
+#define KEYRING_ON_DEMAND_DEFAULT FALSE
+#define KEYRING_ITEM_PATHS_PREF "/plugins/core/purple_gnome_keyring/item_paths"
+#define KEYRING_CACHE_PREF "/plugins/core/purple_gnome_keyring/cache"
+#define KEYRING_CACHE_DEFAULT FALSE
+#define KEYRING_CACHE_TTL_PREF "/plugins/core/purple_gnome_keyring/cache/ttl"
+#define KEYRING_CACHE_TTL_DEFAULT 300
+#define KEYRING_CACHE_PURGE_INTERVAL 60
+#define KEYRING_WRITE_DELAY 1000 // ms, stores of the same account within this window are merged
+#define KEYRING_UNLOAD_TIMEOUT 5000 // ms the last writes of an unload may take before they are cancelled
+#define KEYRING_BULK_WINDOW_PREF "/plugins/core/purple_gnome_keyring/bulk_window"
+#define KEYRING_BULK_WINDOW_DEFAULT 8
+#define KEYRING_BULK_PROGRESS_INTERVAL 1000 // ms between progress lines in the debug log
+#define KEYRING_STATS_FILE "purple-gnome-keyring-stats.json"
+#define KEYRING_DEADLINE_PREF "/plugins/core/purple_gnome_keyring/deadline" // seconds per operation type, 0 = none
+#define KEYRING_DEADLINE_DEFAULT 10
+#define KEYRING_BUS_NAME "org.freedesktop.secrets" // watched to reconnect to a restarted daemon
+#define KEYRING_BACKEND_PREF "/plugins/core/purple_gnome_keyring/backend" // applies when the plugin is loaded
+#define KEYRING_BACKEND_DEFAULT BACKEND_KEYRING
+#define KEYRING_VAULT_FILE "purple-gnome-keyring.vault" // encrypted password file of the vault backend
+#define KEYRING_VAULT_ITERATIONS 200000 // PBKDF2 rounds of a new vault
+
+// Keyring operations with statistics
+typedef enum { OP_SERVICE = 0,
+    OP_COLLECTION = 1,
+    OP_UNLOCK = 2,
+    OP_LOCK = 3,
+    OP_SEARCH = 4,
+    OP_GET_SECRETS = 5,
+    OP_CREATE = 6,
+    OP_SET_ATTRIBUTES = 7,
+    OP_DELETE = 8,
+    OP_COUNT = 9 } operation_type;
+
+// Latency histogram buckets: < 1ms, < 2ms, < 4ms, ..., >= 16s
+#define STATS_BUCKETS 16
 
 // Plugin handles
 const SecretSchema* get_purple_schema(void) G_GNUC_CONST;
@@ -61,18 +133,153 @@ const SecretSchema* get_purple_schema(void) G_GNUC_CONST;
 
 // Vars
 PurplePlugin* gnome_keyring_plugin = NULL;
+backend_type plugin_backend = BACKEND_KEYRING;
+SecretService* plugin_service = NULL;
 SecretCollection* plugin_collection = NULL;
+collection_state plugin_state = COLLECTION_PENDING;
+gboolean unlock_init = FALSE; // init accounts once the running unlock is done
+GQueue waiting_calls = G_QUEUE_INIT; // pipeline calls waiting until the collection is ready
+GCancellable* plugin_cancellable = NULL; // cancelled on unload
+GCancellable* unload_cancellable = NULL; // cancels the last writes of an unload once KEYRING_UNLOAD_TIMEOUT passed
+guint plugin_generation = 0; // callbacks of calls started before the last unload are dropped
+gboolean plugin_unloading = FALSE;
+guint hold_timer = 0;
+gboolean accounts_initialized = FALSE;
+gulong service_signal_handler = 0;
+guint service_generation = 0; // service requests started before the daemon was lost are dropped
+guint secrets_watch = 0;
+gchar* secrets_owner = NULL; // unique bus name of the running keyring daemon
+gboolean secrets_lost = FALSE; // reconnect once the keyring daemon is back on the bus
+guint resolve_collection_timer = 0;
+gchar* resolved_keyring = NULL; // custom keyring name of the last resolve, NULL for the default keyring
+GHashTable* item_paths = NULL;   // index key -> item D-Bus object path
+GHashTable* init_pending = NULL; // accounts waiting for their init password
+GHashTable* account_contexts = NULL; // account -> AccountContext
+guint cache_purge_timer = 0;
+GHashTable* pending_stores = NULL; // accounts with a queued store -> password when it was queued (NULL: none)
+guint store_flush_timer = 0;
+guint sweep_timer = 0;
+guchar written_hash_key[32];
+
+// Per-account state, built once and shared by all keyring calls of the account
+typedef struct {
+    gchar* protocol_id; // attributes were built for this protocol and username
+    gchar* username;
+    gchar* key; // index key of the item
+    GHashTable* attributes;
+    gchar* label;
+
+    SecretValue* cached; // lives in libsecret's locked memory and is wiped on unref
+    gint64 cache_expires;
+    gchar* written_hash; // keyed hash of the value last seen in the keyring
+
+    GQueue calls; // pipeline calls of the account, the head is running
+    gboolean removed; // account is gone, freed once its calls are done
+
+    gboolean held; // password prompt closed until the init password is loaded, connected then
+    guint prompt_timer; // checks if a sign on asked for the password
+} AccountContext;
 
 // Prototypes
+struct PipelineCall;
+static void run_pipeline_call(struct PipelineCall* call);
+static void lose_secret_service();
+static void resume_waiting_calls(const GError* error);
+static gboolean sweep_orphans(gpointer data);
+static void load_wanted_password(PurpleAccount* account);
 static void store_account_password(gpointer data, gpointer user_data);
+static void cancel_pending_store(PurpleAccount* account);
+static void request_vault_passphrase();
+static void load_vault_batch(GList* accounts, void (*release)(PurpleAccount* account, SecretValue* value));
 static void load_account_password(gpointer data, gpointer user_data);
 static void delete_account_password(gpointer data, gpointer user_data);
 
+/**************************************************
+ **************************************************
+ ************ Allocation accounting ***************
+ **************************************************
+ **************************************************/
+
+// Everything the plugin allocates per call or holds on to, to spot leaks in long running sessions
+typedef enum {
+    LIVE_CONTEXT = 0,
+    LIVE_PIPELINE_CALL = 1,
+    LIVE_TIMED_CALL = 2,
+    LIVE_LOOKUP = 3,
+    LIVE_BULK = 4,
+    LIVE_ITEM = 5, // SecretItem proxies handed to the plugin
+    LIVE_COLLECTION = 6, // SecretCollection proxies handed to the plugin
+    LIVE_BATCH = 7,
+    LIVE_MIGRATION = 8,
+    LIVE_COUNT = 9 } live_type;
+
+static const gchar* live_names[LIVE_COUNT] = {
+    "account contexts",
+    "pipeline calls",
+    "keyring calls",
+    "collection lookups",
+    "bulk operations",
+    "item proxies",
+    "collection proxies",
+    "password batches",
+    "migration jobs"
+};
+
+guint live_objects[LIVE_COUNT];
+guint64 allocated_objects[LIVE_COUNT];
+
+// Proxies may be finalized on the keyring worker
+static void count_alloc(live_type type)
+{
+    g_atomic_int_inc((gint*)&live_objects[type]);
+    allocated_objects[type]++;
+}
+
+static void count_free(live_type type)
+{
+    g_atomic_int_add((gint*)&live_objects[type], -1);
+}
+
+static void on_tracked_object_finalized(gpointer data, GObject* object)
+{
+    count_free(GPOINTER_TO_INT(data));
+}
+
+// Count a GObject until it is finalized, e.g. a proxy returned by libsecret
+// libsecret hands out the same cached proxies again (eager init), each one is only counted once
+static void track_object(live_type type, gpointer object)
+{
+    static GQuark tracked = 0;
+
+    if (object == NULL)
+        return;
+
+    if (tracked == 0)
+        tracked = g_quark_from_static_string("purple-gnome-keyring-tracked");
+    if (g_object_get_qdata(object, tracked) != NULL)
+        return;
+
+    g_object_set_qdata(object, tracked, GINT_TO_POINTER(TRUE));
+    count_alloc(type);
+    g_object_weak_ref(object, on_tracked_object_finalized, GINT_TO_POINTER(type));
+}
+
+static void track_items(GList* items)
+{
+    for (GList* li = items; li != NULL; li = li->next)
+        track_object(LIVE_ITEM, li->data);
+}
+
 /**************************************************
  **************************************************
  **************** Schema related ******************
  **************************************************
  **************************************************/
+/*
+ * Version 1 items have no version attribute and the username stored as protocol,
+ * so accounts with the same username on different protocols shared one item.
+ * The schema name is unchanged, a search on the schema finds items of both versions.
+ */
 const SecretSchema* get_purple_schema(void)
 {
     static const SecretSchema schema = {
@@ -80,7 +287,8 @@ const SecretSchema* get_purple_schema(void)
         {
             { "protocol", SECRET_SCHEMA_ATTRIBUTE_STRING },
             { "username", SECRET_SCHEMA_ATTRIBUTE_STRING },
-            { "NULL", 0 },
+            { "version", SECRET_SCHEMA_ATTRIBUTE_INTEGER },
+            { NULL, 0 },
         }
     };
     return &schema;
@@ -90,554 +298,4649 @@ static GHashTable* get_attributes(PurpleAccount* account)
 {
 
     return secret_attributes_build(PURPLE_SCHEMA,
-        "protocol", (gpointer*)purple_account_get_username(account),
-        "username", (gpointer*)purple_account_get_username(account),
+        "protocol", purple_account_get_protocol_id(account),
+        "username", purple_account_get_username(account),
+        "version", KEYRING_SCHEMA_VERSION,
         NULL);
 }
 
+// Build the index key for a (protocol, username) attribute pair
+static gchar* get_index_key(const gchar* protocol, const gchar* username)
+{
+    return g_strconcat(protocol, "\t", username, NULL);
+}
+
 /**************************************************
  **************************************************
- ******************** MESSAGES ********************
+ **************** Account contexts ****************
  **************************************************
  **************************************************/
-//PurpleNotifyMsgType { PURPLE_NOTIFY_MSG_ERROR = 0, PURPLE_NOTIFY_MSG_WARNING, PURPLE_NOTIFY_MSG_INFO }
-// Show error dialog
-static void dialog(PurpleNotifyMsgType type, const gchar* prim, const gchar* sec)
+
+// Drop everything derived from the username or protocol of the account
+static void clear_account_context(AccountContext* context)
 {
-    purple_notify_message(
-        gnome_keyring_plugin,
-        type,
-        "Gnome Keyring Plugin",
-        prim,
-        sec,
-        NULL,
-        NULL);
+    g_free(context->protocol_id);
+    g_free(context->username);
+    g_free(context->key);
+    g_free(context->label);
+    g_free(context->written_hash);
+    g_clear_pointer(&context->attributes, g_hash_table_unref);
+    g_clear_pointer(&context->cached, secret_value_unref);
+
+    context->protocol_id = NULL;
+    context->username = NULL;
+    context->key = NULL;
+    context->label = NULL;
+    context->written_hash = NULL;
 }
 
-// Unified Error messages
-static void print_protocol_error_message(const gchar* protocol_name, gchar* prim_msg, GError* error)
+static void free_account_context(gpointer data)
 {
-    GString* msg = g_string_new(NULL);
-    g_string_append_printf(msg, "Error in %s account: %s", protocol_name, prim_msg);
+    AccountContext* context = (AccountContext*)data;
+
+    clear_account_context(context);
+    g_queue_clear(&context->calls);
+    if (context->prompt_timer != 0)
+        purple_timeout_remove(context->prompt_timer);
+    g_free(context);
+    count_free(LIVE_CONTEXT);
+}
 
-    dialog(PURPLE_NOTIFY_MSG_ERROR,
-        msg->str,
-        error->message);
-    g_error_free(error);
-    g_string_free(msg, TRUE);
+// Context of an account, rebuilt if the account got another username or protocol
+static AccountContext* get_account_context(PurpleAccount* account)
+{
+    AccountContext* context = g_hash_table_lookup(account_contexts, account);
+
+    if ((context != NULL)
+        && (g_strcmp0(context->protocol_id, purple_account_get_protocol_id(account)) == 0)
+        && (g_strcmp0(context->username, purple_account_get_username(account)) == 0))
+        return context;
+
+    if (context == NULL) {
+        context = g_new0(AccountContext, 1);
+        count_alloc(LIVE_CONTEXT);
+        g_queue_init(&context->calls);
+        g_hash_table_insert(account_contexts, account, context);
+    } else {
+        clear_account_context(context);
+    }
+
+    context->protocol_id = g_strdup(purple_account_get_protocol_id(account));
+    context->username = g_strdup(purple_account_get_username(account));
+    context->attributes = get_attributes(account);
+    context->key = get_index_key(g_hash_table_lookup(context->attributes, "protocol"),
+        g_hash_table_lookup(context->attributes, "username"));
+    context->label = g_strdup_printf("Purple %s password for user: %s", purple_account_get_protocol_name(account), context->username);
+
+    return context;
 }
 
-// Determine next action
-/* static void nextAction(PurpleAccount* account, int status) */
-/* { */
-/*     switch(status) */
-/*     { */
-/*         case LOADING: */
-/*             load_account_password(account, NULL); */
-/*             break; */
-/*         case STORING: */
-/*             store_account_password(account, NULL); */
-/*             break; */
-/*         case DELETING: */
-/*             delete_account_password(account, NULL); */
-/*             break; */
-/*     } */
-/* } */
+// Detach the context of a removed account, its pending calls still finish with it
+static void release_account_context(PurpleAccount* account)
+{
+    AccountContext* context = g_hash_table_lookup(account_contexts, account);
+
+    if (context == NULL)
+        return;
+
+    g_hash_table_steal(account_contexts, account);
+    if (context->prompt_timer != 0) {
+        purple_timeout_remove(context->prompt_timer);
+        context->prompt_timer = 0;
+    }
+    if (g_queue_is_empty(&context->calls))
+        free_account_context(context);
+    else
+        context->removed = TRUE;
+}
+
+// Drop all contexts on unload, the ones with running calls are freed when those finish
+static void release_account_contexts()
+{
+    GList* accounts = g_hash_table_get_keys(account_contexts);
+
+    for (GList* li = accounts; li != NULL; li = li->next)
+        release_account_context(li->data);
+    g_list_free(accounts);
+
+    g_hash_table_destroy(account_contexts);
+    account_contexts = NULL;
+}
 
 /**************************************************
  **************************************************
- *********** Collection initalization *************
+ ****************** Item paths ********************
  **************************************************
  **************************************************/
-static void on_init_item_loaded(GObject* source,
-    GAsyncResult* result,
-    gpointer user_data)
-{
-    PurpleAccount* account = (PurpleAccount*)user_data;
 
-    GError* error = NULL;
-    GList* items = secret_collection_search_finish(plugin_collection, result, &error);
+// Restore the item path index from prefs
+static void load_item_paths()
+{
+    GList* entries = purple_prefs_get_string_list(KEYRING_ITEM_PATHS_PREF);
 
-    if (error != NULL) {
-        print_protocol_error_message(purple_account_get_protocol_name(account), "Could not read init password", error);
-    } else if (items == NULL) {
-        purple_debug_info(PLUGIN_ID, "%s: Init password is empty - no password saved\n", account->protocol_id);
-    } else {
-        SecretItem* item = items->data;
-        SecretValue* value = secret_item_get_secret(item);
+    for (GList* li = entries; li != NULL; li = li->next) {
+        gchar* entry = li->data;
+        gchar* sep = strrchr(entry, '\t');
 
-        purple_debug_info(PLUGIN_ID, "Setting init password for %s with username %s\n", account->protocol_id, account->username);
-        purple_account_set_password(account, secret_value_get_text(value));
+        if ((sep != NULL) && (sep != entry) && (sep[1] == '/'))
+            g_hash_table_replace(item_paths, g_strndup(entry, sep - entry), g_strdup(sep + 1));
 
-        secret_value_unref(value);
-        g_object_unref(item);
-        g_list_free(items);
+        g_free(entry);
     }
 
-    purple_request_close_with_handle(account);
-    purple_account_set_enabled(account, purple_core_get_ui(), TRUE);
+    g_list_free(entries);
+    purple_debug_info(PLUGIN_ID, "Restored %u item paths\n", g_hash_table_size(item_paths));
 }
 
-// This will do the trick
-static void init_account(gpointer data, gpointer user_data)
+// Persist the item path index next to the other prefs
+static void save_item_paths()
 {
-    PurpleAccount* account = (PurpleAccount*)data;
-
-    if (!purple_account_get_remember_password(account)) {
-
-        /* unlock_collection(plugin_collection); */
-        purple_debug_info(PLUGIN_ID, "Loading init password %s with username %s\n", account->protocol_id, account->username);
-        purple_account_set_enabled(account, purple_core_get_ui(), FALSE);
+    GList* entries = NULL;
+    GHashTableIter iter;
+    gpointer key, path;
 
-        secret_collection_search(plugin_collection,
-            PURPLE_SCHEMA,
-            get_attributes(account),
-            SECRET_SEARCH_UNLOCK | SECRET_SEARCH_LOAD_SECRETS,
-            NULL,
-            on_init_item_loaded,
-            data);
+    g_hash_table_iter_init(&iter, item_paths);
+    while (g_hash_table_iter_next(&iter, &key, &path))
+        entries = g_list_prepend(entries, g_strconcat(key, "\t", path, NULL));
 
-        /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
-    }
+    purple_prefs_set_string_list(KEYRING_ITEM_PATHS_PREF, entries);
+    g_list_free_full(entries, g_free);
 }
 
-// Deferred enabling of accounts
-static void init_accounts()
+// Remember where the item of an index key lives, returns TRUE if the index changed
+static gboolean remember_item_path(const gchar* key, SecretItem* item)
 {
-    /* GList* accounts     = purple_accounts_get_all(); */
-    purple_debug_info(PLUGIN_ID, "Init accounts\n");
+    const gchar* path = g_dbus_proxy_get_object_path(G_DBUS_PROXY(item));
 
-    GList* accounts = purple_accounts_get_all_active();
-    g_list_foreach(accounts, init_account, NULL);
-    g_list_free(accounts);
+    if ((path == NULL) || (g_strcmp0(g_hash_table_lookup(item_paths, key), path) == 0))
+        return FALSE;
+
+    g_hash_table_replace(item_paths, g_strdup(key), g_strdup(path));
+    return TRUE;
 }
 
-// Callback to lock collection
-static void on_collection_locked(GObject* source,
-    GAsyncResult* result,
-    gpointer user_data)
+static void remember_account_item_path(AccountContext* context, SecretItem* item)
 {
+    if (remember_item_path(context->key, item))
+        save_item_paths();
+}
 
-    GError* error = NULL;
-    GList* locked_collections = NULL;
+static void forget_account_item_path(AccountContext* context)
+{
+    if (g_hash_table_remove(item_paths, context->key))
+        save_item_paths();
+}
 
-    secret_service_lock_finish(SECRET_SERVICE(source),
-        result,
-        &locked_collections,
-        &error);
+// Drop a path once its item is deleted, unless the key points at a newer item meanwhile
+static void forget_item_path(const gchar* key, SecretItem* item)
+{
+    if (g_strcmp0(g_hash_table_lookup(item_paths, key), g_dbus_proxy_get_object_path(G_DBUS_PROXY(item))) != 0)
+        return;
 
-    if (error != NULL) {
-        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not lock Gnome Keyring.", error->message);
-        g_error_free(error);
-    } else if (locked_collections != NULL) {
-        purple_debug_info(PLUGIN_ID, "Successfully locked collection\n");
-        plugin_collection = locked_collections->data;
-        g_list_free(locked_collections);
-    }
+    g_hash_table_remove(item_paths, key);
+    save_item_paths();
 }
 
-// lock collection
-static gboolean lock_collection()
+static const gchar* lookup_account_item_path(AccountContext* context)
 {
-    gboolean was_unlocked = FALSE;
-    purple_debug_info(PLUGIN_ID, "Locking collection\n");
+    return g_hash_table_lookup(item_paths, context->key);
+}
 
-    if ((plugin_collection != NULL) && (!secret_collection_get_locked(plugin_collection))) {
-        was_unlocked = TRUE;
+// Drop the paths of items outside the collection, e.g. after switching to another keyring
+static void forget_foreign_item_paths(SecretCollection* collection)
+{
+    gchar* prefix = g_strconcat(g_dbus_proxy_get_object_path(G_DBUS_PROXY(collection)), "/", NULL);
+    GHashTableIter iter;
+    gpointer path;
+    guint removed = 0;
+
+    g_hash_table_iter_init(&iter, item_paths);
+    while (g_hash_table_iter_next(&iter, NULL, &path)) {
+        if (!g_str_has_prefix(path, prefix)) {
+            g_hash_table_iter_remove(&iter);
+            removed++;
+        }
+    }
 
-        GList* unlocked_collections = NULL;
-        unlocked_collections = g_list_append(unlocked_collections, plugin_collection);
+    if (removed > 0) {
+        purple_debug_info(PLUGIN_ID, "Dropped %u item paths of another keyring\n", removed);
+        save_item_paths();
+    }
+    g_free(prefix);
+}
 
-        secret_service_lock(
-            secret_collection_get_service(plugin_collection),
-            unlocked_collections,
-            NULL,
-            on_collection_locked,
-            NULL);
+/**************************************************
+ **************************************************
+ ***************** Secret cache *******************
+ **************************************************
+ **************************************************/
 
-        g_list_free(unlocked_collections);
+static void cache_account_secret(AccountContext* context, SecretValue* value)
+{
+    if (!purple_prefs_get_bool(KEYRING_CACHE_PREF) || (value == NULL))
+        return;
 
-    } else {
-        purple_debug_info(PLUGIN_ID, "Collection already locked\n");
-        /* nextAction(status); */
-    }
+    secret_value_ref(value);
+    g_clear_pointer(&context->cached, secret_value_unref);
 
-    return was_unlocked;
+    context->cached = value;
+    context->cache_expires = g_get_monotonic_time() + (gint64)purple_prefs_get_int(KEYRING_CACHE_TTL_PREF) * G_USEC_PER_SEC;
 }
 
-// Callback to unlock collection
-static void on_collection_unlocked(GObject* source,
-    GAsyncResult* result,
-    gpointer user_data)
+// Returns a borrowed value, or NULL if nothing valid is cached
+static SecretValue* lookup_cached_secret(AccountContext* context)
 {
+    if (!purple_prefs_get_bool(KEYRING_CACHE_PREF))
+        return NULL;
 
-    GError* error = NULL;
-    GList* unlocked_collections = NULL;
-
-    secret_service_unlock_finish(SECRET_SERVICE(source),
-        result,
-        &unlocked_collections,
-        &error);
-
-    if (error != NULL) {
-        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not unlock Gnome Keyring.", error->message);
-        g_error_free(error);
-    } else if (unlocked_collections != NULL) {
-        purple_debug_info(PLUGIN_ID, "Successfully unlocked collection\n");
+    if ((context->cached != NULL) && (context->cache_expires <= g_get_monotonic_time()))
+        g_clear_pointer(&context->cached, secret_value_unref);
 
-        plugin_collection = unlocked_collections->data;
-        if (GPOINTER_TO_INT(user_data) == INITIALIZING)
-            init_accounts();
+    return context->cached;
+}
 
-        g_list_free(unlocked_collections);
-    }
+static void invalidate_cached_secret(AccountContext* context)
+{
+    g_clear_pointer(&context->cached, secret_value_unref);
 }
 
-// Unlock collection
-static gboolean unlock_collection(SecretCollection* collection, gpointer status)
+// Wipe expired secrets, or all of them if the cache got disabled
+static gboolean purge_secret_cache(gpointer data)
 {
-    gboolean was_locked = FALSE;
-    purple_debug_info(PLUGIN_ID, "Unlocking collection (if necessary)\n");
+    gint64 now = g_get_monotonic_time();
+    gboolean enabled = purple_prefs_get_bool(KEYRING_CACHE_PREF);
+    GHashTableIter iter;
+    gpointer context;
+
+    g_hash_table_iter_init(&iter, account_contexts);
+    while (g_hash_table_iter_next(&iter, NULL, &context)) {
+        if (!enabled || (((AccountContext*)context)->cache_expires <= now))
+            invalidate_cached_secret(context);
+    }
 
-    if ((collection != NULL) && (secret_collection_get_locked(collection))) {
-        was_locked = TRUE;
+    return TRUE;
+}
 
-        GList* locked_collections = NULL;
-        locked_collections = g_list_append(locked_collections, collection);
+// Fill data from the kernel CSPRNG, g_random_* is predictable
+static gboolean read_random_bytes(guchar* data, gsize length, GError** error)
+{
+    gint fd = g_open("/dev/urandom", O_RDONLY | O_CLOEXEC, 0);
+    gsize done = 0;
 
-        purple_debug_info(PLUGIN_ID, "Unlocking collection\n");
-        secret_service_unlock(secret_collection_get_service(collection),
-            locked_collections,
-            NULL,
-            on_collection_unlocked,
-            status);
+    if (fd < 0) {
+        gint saved = errno;
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved), "Could not open /dev/urandom: %s", g_strerror(saved));
+        return FALSE;
+    }
 
-        g_list_free(locked_collections);
+    while (done < length) {
+        gssize n = read(fd, data + done, length - done);
 
-    } else if (collection != NULL) {
-        plugin_collection = collection;
-        if (GPOINTER_TO_INT(status) == INITIALIZING)
-            init_accounts();
-        purple_debug_info(PLUGIN_ID, "Collection already unlocked\n");
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0) {
+            gint saved = (n < 0) ? errno : EIO;
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved), "Could not read /dev/urandom: %s", g_strerror(saved));
+            close(fd);
+            return FALSE;
+        }
+        done += n;
     }
 
-    g_object_unref(collection);
+    close(fd);
+    return TRUE;
+}
 
-    return was_locked;
+// Keyed hash of a password, the per-session key keeps plain hashes out of memory
+static gchar* hash_secret(const gchar* password)
+{
+    return g_compute_hmac_for_data(G_CHECKSUM_SHA256,
+        written_hash_key, sizeof(written_hash_key),
+        (const guchar*)password, strlen(password));
 }
 
-// Load alias collection callback
-static void on_got_alias_collection(GObject* source,
-    GAsyncResult* result,
-    gpointer user_data)
+// Remember which password is in the keyring for an account
+static void remember_written_secret(AccountContext* context, const gchar* password)
 {
+    if (password == NULL)
+        return;
 
-    GError* error = NULL;
-    SecretCollection* collection = secret_collection_for_alias_finish(result, &error);
+    g_free(context->written_hash);
+    context->written_hash = hash_secret(password);
+}
 
-    if (error != NULL) {
-        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not load collection.", error->message);
-        g_error_free(error);
-    } else if (collection != NULL) {
-        purple_debug_info(PLUGIN_ID, "Successfully loaded default collection\n");
-        unlock_collection(collection, GINT_TO_POINTER(INITIALIZING));
-    } else
-        purple_debug_info(PLUGIN_ID, "No collection received - load collections first\n");
+static void forget_written_secret(AccountContext* context)
+{
+    g_free(context->written_hash);
+    context->written_hash = NULL;
 }
 
-// Determine and load correct keyring
-static void init_collection(SecretService* service)
+static gboolean is_secret_written(AccountContext* context, const gchar* password)
 {
+    gchar* hash = hash_secret(password);
+    gboolean written = (g_strcmp0(context->written_hash, hash) == 0);
 
-    purple_debug_info(PLUGIN_ID, "Initializing secret collection\n");
+    g_free(hash);
+    return written;
+}
 
-    // Check if user defined a different collection name (not the alias default)
-    if (purple_prefs_get_bool(KEYRING_CUSTOM_NAME_PREF)) {
+/**************************************************
+ **************************************************
+ ******************** MESSAGES ********************
+ **************************************************
+ **************************************************/
+//PurpleNotifyMsgType { PURPLE_NOTIFY_MSG_ERROR = 0, PURPLE_NOTIFY_MSG_WARNING, PURPLE_NOTIFY_MSG_INFO }
+// Show error dialog
+static void dialog(PurpleNotifyMsgType type, const gchar* prim, const gchar* sec)
+{
+    purple_notify_message(
+        gnome_keyring_plugin,
+        type,
+        "Gnome Keyring Plugin",
+        prim,
+        sec,
+        NULL,
+        NULL);
+}
 
-        const gchar* collection_name = purple_prefs_get_string(KEYRING_NAME_PREF);
-        GList* collections = secret_service_get_collections(service); // already loads collection items
+// Unified Error messages
+static void print_protocol_error_message(const gchar* protocol_name, gchar* prim_msg, GError* error)
+{
+    GString* msg = g_string_new(NULL);
+    g_string_append_printf(msg, "Error in %s account: %s", protocol_name, prim_msg);
 
-        if (!collections) {
-            purple_debug_info(PLUGIN_ID, "Could not load keyrings. Check if DBus in running!\n");
-        } else {
+    dialog(PURPLE_NOTIFY_MSG_ERROR,
+        msg->str,
+        error->message);
+    g_error_free(error);
+    g_string_free(msg, TRUE);
+}
 
-            for (GList* li = collections; li != NULL; li = li->next) {
-                gchar* label = secret_collection_get_label(li->data);
-                if (strcmp(label, collection_name) == 0) {
-                    unlock_collection(li->data, GINT_TO_POINTER(INITIALIZING));
-                    purple_debug_info(PLUGIN_ID, "Determine collection by name: %s\n", label);
-                    break;
-                }
-            }
+/**************************************************
+ **************************************************
+ **************** Pipeline calls ******************
+ **************************************************
+ **************************************************/
 
-            g_list_free(collections);
-        }
+// Completion hook of a pipeline call, error is NULL on success, skipped if there was nothing to do
+typedef void (*PipelineDoneFunc)(PurpleAccount* account, const GError* error, gboolean skipped, gpointer user_data);
+
+typedef enum {
+    PIPELINE_LOAD,
+    PIPELINE_STORE,
+    PIPELINE_DELETE
+} pipeline_type;
+
+// State of one load / store / delete pipeline run for an account
+typedef struct PipelineCall {
+    PurpleAccount* account;
+    AccountContext* context;
+    GCancellable* cancellable;
+    PipelineDoneFunc done; // NULL reports errors with a dialog
+    gpointer done_data;
+
+    // Set by pipeline_submit
+    pipeline_type type;
+    void (*run)(struct PipelineCall* call);
+    GList* waiters; // merged calls, finished with the result of this one
+    gboolean queued;
+    gboolean retried; // ran again after the keyring daemon was lost
+    gboolean skipped; // finished without writing, e.g. no or an unchanged password
+    SecretValue* value; // password a store writes, NULL: the current password of the account
+} PipelineCall;
+
+static PipelineCall* pipeline_call_new(PurpleAccount* account, GCancellable* cancellable, PipelineDoneFunc done, gpointer done_data)
+{
+    PipelineCall* call = g_new0(PipelineCall, 1);
+    count_alloc(LIVE_PIPELINE_CALL);
+    call->account = account;
+
+    // A removed account may be freed already, only its existing context is used (none: the call is skipped)
+    if (g_list_find(purple_accounts_get_all(), account) != NULL)
+        call->context = get_account_context(account);
+    else
+        call->context = g_hash_table_lookup(account_contexts, account);
+    call->cancellable = (cancellable != NULL) ? g_object_ref(cancellable) : NULL;
+    call->done = done;
+    call->done_data = done_data;
+
+    return call;
+}
 
-    } else {
-        purple_debug_info(PLUGIN_ID, "Loading default (alias) collection\n");
-        secret_collection_for_alias(service,
-            SECRET_COLLECTION_DEFAULT,
-            SECRET_COLLECTION_LOAD_ITEMS,
-            NULL,
-            on_got_alias_collection,
-            NULL);
-    }
+static void free_pipeline_call(PipelineCall* call)
+{
+    if (call->cancellable != NULL)
+        g_object_unref(call->cancellable);
+    if (call->value != NULL)
+        secret_value_unref(call->value);
+    g_free(call);
+    count_free(LIVE_PIPELINE_CALL);
 }
 
-// Get service callback
-static void on_got_service(GObject* source,
-    GAsyncResult* result,
-    gpointer user_data)
+// Password of a store call, taken when it was queued or else the current one
+static const gchar* get_store_password(PipelineCall* call)
 {
+    if (call->value != NULL)
+        return secret_value_get_text(call->value);
 
-    GError* error = NULL;
+    return purple_account_get_password(call->account);
+}
+
+// Start the next queued call of the account once the running one is done
+static void pipeline_call_dequeue(PipelineCall* call)
+{
+    AccountContext* context = call->context;
+    PipelineCall* next = NULL;
+
+    if (g_queue_peek_head(&context->calls) != call)
+        return;
+
+    g_queue_pop_head(&context->calls);
+    next = g_queue_peek_head(&context->calls);
+
+    if ((next != NULL) && (account_contexts != NULL)) {
+        run_pipeline_call(next);
+    } else if (context->removed) {
+        // Plugin was unloaded, calls that did not start yet are dropped
+        while ((next = g_queue_pop_head(&context->calls)) != NULL) {
+            g_list_free_full(next->waiters, (GDestroyNotify)free_pipeline_call);
+            free_pipeline_call(next);
+        }
+        free_account_context(context);
+    }
+}
+
+// The account of a delete is usually gone when it finishes, so messages only use the context
+static const gchar* get_call_protocol_name(PipelineCall* call)
+{
+    PurplePlugin* prpl = purple_find_prpl(call->context->protocol_id);
+
+    return (prpl != NULL) ? purple_plugin_get_name(prpl) : call->context->protocol_id;
+}
+
+// Error of a call whose keyring daemon left the bus before replying
+static gboolean is_service_lost(const GError* error)
+{
+    // Not NO_REPLY: a slow daemon times out the same way, the name watcher sees a real restart
+    return g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN)
+        || g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_NAME_HAS_NO_OWNER)
+        || g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_DISCONNECTED);
+}
+
+// Report the result of a pipeline call and its merged calls and free them, takes ownership of error
+// A NULL prim_msg passes the error only to completion hooks
+static void pipeline_call_finish(PipelineCall* call, gchar* prim_msg, GError* error)
+{
+    GList* calls = NULL;
+    gboolean reported = FALSE;
+
+    // Run once more against the restarted daemon, queued until it is back
+    if ((error != NULL) && is_service_lost(error) && !call->retried) {
+        purple_debug_info(PLUGIN_ID, "Keyring daemon lost, retrying call for %s\n", call->context->username);
+        call->retried = TRUE;
+        g_error_free(error);
+        lose_secret_service();
+        run_pipeline_call(call);
+        return;
+    }
+
+    calls = g_list_prepend(call->waiters, call);
+
+    for (GList* li = calls; li != NULL; li = li->next) {
+        PipelineCall* c = li->data;
+
+        if (c->done != NULL) {
+            c->done(c->account, error, call->skipped, c->done_data);
+        } else if ((error != NULL) && !reported && (prim_msg != NULL)) {
+            // Only one dialog for merged calls, none if the error was shown already
+            print_protocol_error_message(get_call_protocol_name(c), prim_msg, g_error_copy(error));
+            reported = TRUE;
+        }
+    }
+
+    if (error != NULL)
+        g_error_free(error);
+
+    if (call->queued)
+        pipeline_call_dequeue(call);
+
+    g_list_free_full(calls, (GDestroyNotify)free_pipeline_call);
+}
+
+// Finish a call that had nothing to do
+static void pipeline_call_skip(PipelineCall* call)
+{
+    call->skipped = TRUE;
+    pipeline_call_finish(call, NULL, NULL);
+}
+
+/*
+ * Calls of one account run one at a time, in the order they were submitted:
+ * - a load or delete merges into the last queued call of the same type, even if it already runs
+ * - a store merges into the last queued store only until that one starts, since it reads the password when it runs
+ * - calls only merge if they share the cancellable, cancelling e.g. a bulk operation must not cancel a single call
+ * - any other call waits for the calls queued before it, e.g. a load after a store reads the new password
+ */
+static void pipeline_submit(PipelineCall* call, pipeline_type type, void (*run)(PipelineCall* call))
+{
+    GQueue* queue = &call->context->calls;
+    PipelineCall* last = NULL;
+
+    call->type = type;
+    call->run = run;
+
+    if (call->context == NULL) {
+        pipeline_call_skip(call);
+        return;
+    }
+
+    last = g_queue_peek_tail(queue);
+    if ((last != NULL) && (last->type == type) && (last->cancellable == call->cancellable)
+        && ((type != PIPELINE_STORE) || (last != g_queue_peek_head(queue)))) {
+        purple_debug_info(PLUGIN_ID, "Merging call into pending call for %s\n", call->context->username);
+        last->waiters = g_list_append(last->waiters, call);
+
+        // The pending store writes the newest password
+        if (type == PIPELINE_STORE) {
+            if (last->value != NULL)
+                secret_value_unref(last->value);
+            last->value = call->value;
+            call->value = NULL;
+        }
+        return;
+    }
+
+    call->queued = TRUE;
+    g_queue_push_tail(queue, call);
+
+    if (g_queue_get_length(queue) == 1)
+        run_pipeline_call(call);
+}
+
+/**************************************************
+ **************************************************
+ ****************** Statistics ********************
+ **************************************************
+ **************************************************/
+
+typedef struct {
+    guint count;
+    guint errors;
+    guint timeouts;
+    gint64 total;
+    gint64 max;
+    guint buckets[STATS_BUCKETS];
+} OperationStats;
+
+static const gchar* operation_names[OP_COUNT] = {
+    "service get",
+    "collection lookup",
+    "unlock",
+    "lock",
+    "search",
+    "get secrets",
+    "create",
+    "set attributes",
+    "delete"
+};
+
+// The unlock may wait for the user to type the keyring password
+static const gint operation_deadline_defaults[OP_COUNT] = {
+    KEYRING_DEADLINE_DEFAULT,
+    KEYRING_DEADLINE_DEFAULT,
+    0,
+    KEYRING_DEADLINE_DEFAULT,
+    KEYRING_DEADLINE_DEFAULT,
+    KEYRING_DEADLINE_DEFAULT,
+    KEYRING_DEADLINE_DEFAULT,
+    KEYRING_DEADLINE_DEFAULT,
+    KEYRING_DEADLINE_DEFAULT
+};
+
+static const gchar* operation_deadline_prefs[OP_COUNT] = {
+    KEYRING_DEADLINE_PREF "/service",
+    KEYRING_DEADLINE_PREF "/collection",
+    KEYRING_DEADLINE_PREF "/unlock",
+    KEYRING_DEADLINE_PREF "/lock",
+    KEYRING_DEADLINE_PREF "/search",
+    KEYRING_DEADLINE_PREF "/get_secrets",
+    KEYRING_DEADLINE_PREF "/create",
+    KEYRING_DEADLINE_PREF "/set_attributes",
+    KEYRING_DEADLINE_PREF "/delete"
+};
+
+OperationStats operation_stats[OP_COUNT];
+
+// Pending libsecret call, wraps the real callback to measure its latency and enforce its deadline
+typedef struct {
+    operation_type op;
+    gint64 started;
+    GAsyncReadyCallback callback;
+    gpointer user_data;
+    GDestroyNotify abandon; // frees user_data if the plugin was unloaded meanwhile
+    guint generation;
+
+    GCancellable* cancellable; // pass this one to libsecret
+    GCancellable* parent;
+    GCancellable* plugin;
+    gulong parent_handler;
+    gulong plugin_handler;
+    guint deadline_timer;
+    gboolean expired;
+} TimedCall;
+
+static void record_operation(operation_type op, gint64 elapsed)
+{
+    OperationStats* stats = &operation_stats[op];
+    guint bucket = 0;
+
+    for (gint64 ms = elapsed / 1000; (ms > 0) && (bucket < STATS_BUCKETS - 1); ms >>= 1)
+        bucket++;
+
+    stats->count++;
+    stats->total += elapsed;
+    stats->max = MAX(stats->max, elapsed);
+    stats->buckets[bucket]++;
+}
+
+// Called by the operation callbacks if their finish function failed
+static void record_operation_error(operation_type op)
+{
+    operation_stats[op].errors++;
+}
+
+static void on_timed_call(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    TimedCall* timed = (TimedCall*)user_data;
+
+    if (timed->deadline_timer != 0)
+        purple_timeout_remove(timed->deadline_timer);
+    if (timed->parent_handler != 0)
+        g_cancellable_disconnect(timed->parent, timed->parent_handler);
+    if (timed->plugin_handler != 0)
+        g_cancellable_disconnect(timed->plugin, timed->plugin_handler);
+
+    record_operation(timed->op, g_get_monotonic_time() - timed->started);
+    if (timed->expired)
+        operation_stats[timed->op].timeouts++;
+
+    if (timed->generation == plugin_generation)
+        timed->callback(source, result, timed->user_data);
+    else if (timed->abandon != NULL)
+        timed->abandon(timed->user_data);
+
+    if (timed->parent != NULL)
+        g_object_unref(timed->parent);
+    if (timed->plugin != NULL)
+        g_object_unref(timed->plugin);
+    g_object_unref(timed->cancellable);
+    g_free(timed);
+    count_free(LIVE_TIMED_CALL);
+}
+
+static gboolean on_deadline_expired(gpointer data)
+{
+    TimedCall* timed = (TimedCall*)data;
+
+    purple_debug_info(PLUGIN_ID, "Deadline of %s call expired\n", operation_names[timed->op]);
+    timed->deadline_timer = 0;
+    timed->expired = TRUE;
+    g_cancellable_cancel(timed->cancellable);
+
+    return FALSE;
+}
+
+static void cancel_timed_call(GCancellable* parent, gpointer data)
+{
+    g_cancellable_cancel(G_CANCELLABLE(data));
+}
+
+/*
+ * Pass to one of the keyring_* calls, which run the libsecret call on the worker and hand its result to callback.
+ * The call is cancelled by its deadline, by parent (may be NULL) and by unloading the plugin.
+ */
+static TimedCall* timed_call_new(operation_type op, GCancellable* parent, GAsyncReadyCallback callback, gpointer user_data, GDestroyNotify abandon)
+{
+    TimedCall* timed = g_new0(TimedCall, 1);
+    count_alloc(LIVE_TIMED_CALL);
+    gint deadline = purple_prefs_get_int(operation_deadline_prefs[op]);
+
+    timed->op = op;
+    timed->started = g_get_monotonic_time();
+    timed->callback = callback;
+    timed->user_data = user_data;
+    timed->abandon = abandon;
+    timed->generation = plugin_generation;
+    timed->cancellable = g_cancellable_new();
+
+    if (parent != NULL) {
+        timed->parent = g_object_ref(parent);
+        timed->parent_handler = g_cancellable_connect(parent, G_CALLBACK(cancel_timed_call), timed->cancellable, NULL);
+    }
+
+    // Last writes of an unload are not cancelled with the rest, only if they take too long
+    GCancellable* plugin = plugin_unloading ? unload_cancellable : plugin_cancellable;
+    if (plugin != NULL) {
+        timed->plugin = g_object_ref(plugin);
+        timed->plugin_handler = g_cancellable_connect(plugin, G_CALLBACK(cancel_timed_call), timed->cancellable, NULL);
+    }
+
+    if (deadline > 0)
+        timed->deadline_timer = purple_timeout_add_seconds(deadline, on_deadline_expired, timed);
+
+    return timed;
+}
+
+// Abandon handler of pipeline calls
+static void abandon_pipeline_call(gpointer data)
+{
+    pipeline_call_finish((PipelineCall*)data, NULL, g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Plugin was unloaded"));
+}
+
+// Bucket bound of the given percentile, e.g. "< 8 ms"
+static gchar* stats_percentile(OperationStats* stats, guint p)
+{
+    guint rank = (stats->count * p + 99) / 100;
+    guint seen = 0;
+    guint i = 0;
+
+    for (; i < STATS_BUCKETS - 1; i++) {
+        seen += stats->buckets[i];
+        if ((seen >= rank) && (seen > 0))
+            return g_strdup_printf("< %u ms", 1u << i);
+    }
+
+    return g_strdup_printf(">= %u ms", 1u << (i - 1));
+}
+
+static gchar* get_stats_text()
+{
+    GString* text = g_string_new(NULL);
+
+    for (guint op = 0; op < OP_COUNT; op++) {
+        OperationStats* stats = &operation_stats[op];
+
+        if (stats->count == 0) {
+            g_string_append_printf(text, "%s: no calls\n", operation_names[op]);
+            continue;
+        }
+
+        gchar* p50 = stats_percentile(stats, 50);
+        gchar* p99 = stats_percentile(stats, 99);
+
+        g_string_append_printf(text, "%s: %u calls, %u errors, %u timeouts, avg %.1f ms, max %.1f ms, p50 %s, p99 %s\n",
+            operation_names[op],
+            stats->count,
+            stats->errors,
+            stats->timeouts,
+            stats->total / 1000.0 / stats->count,
+            stats->max / 1000.0,
+            p50,
+            p99);
+
+        g_free(p50);
+        g_free(p99);
+    }
+
+    g_string_append(text, "\nLive objects (allocated in total):\n");
+    for (guint type = 0; type < LIVE_COUNT; type++)
+        g_string_append_printf(text, "%s: %u (%" G_GUINT64_FORMAT ")\n", live_names[type], live_objects[type], allocated_objects[type]);
+
+    return g_string_free(text, FALSE);
+}
+
+static gchar* get_stats_json()
+{
+    GString* json = g_string_new("{\n  \"bucket_upper_bounds_ms\": [");
+
+    for (guint i = 0; i < STATS_BUCKETS - 1; i++)
+        g_string_append_printf(json, "%s%u", (i > 0) ? ", " : "", 1u << i);
+    g_string_append(json, ", null],\n  \"operations\": {");
+
+    for (guint op = 0; op < OP_COUNT; op++) {
+        OperationStats* stats = &operation_stats[op];
+
+        g_string_append_printf(json, "%s\n    \"%s\": { \"count\": %u, \"errors\": %u, \"timeouts\": %u, \"total_us\": %" G_GINT64_FORMAT ", \"max_us\": %" G_GINT64_FORMAT ", \"histogram\": [",
+            (op > 0) ? "," : "",
+            operation_names[op],
+            stats->count,
+            stats->errors,
+            stats->timeouts,
+            stats->total,
+            stats->max);
+
+        for (guint i = 0; i < STATS_BUCKETS; i++)
+            g_string_append_printf(json, "%s%u", (i > 0) ? ", " : "", stats->buckets[i]);
+        g_string_append(json, "] }");
+    }
+
+    g_string_append(json, "\n  },\n  \"live_objects\": {");
+
+    for (guint type = 0; type < LIVE_COUNT; type++) {
+        g_string_append_printf(json, "%s\n    \"%s\": { \"live\": %u, \"allocated\": %" G_GUINT64_FORMAT " }",
+            (type > 0) ? "," : "",
+            live_names[type],
+            live_objects[type],
+            allocated_objects[type]);
+    }
+
+    g_string_append(json, "\n  }\n}\n");
+    return g_string_free(json, FALSE);
+}
+
+/**************************************************
+ **************************************************
+ ***************** Keyring worker *****************
+ **************************************************
+ **************************************************/
+
+/*
+ * libsecret calls are started on a worker thread that runs its own GMainContext, so the proxies, prompts and
+ * result handling of libsecret never run on the UI main loop. Results and D-Bus signals come back through a
+ * lock-free stack that a single idle callback per batch drains on the main loop (the default GMainContext of
+ * Pidgin and Finch). All callbacks of the plugin keep running on the main loop.
+ */
+
+// Something to run on the main loop, pushed by the worker thread
+typedef struct KeyringEvent {
+    struct KeyringEvent* next;
+    void (*deliver)(gpointer data);
+    gpointer data;
+} KeyringEvent;
+
+// Arguments of a libsecret call, started on the worker thread
+typedef struct KeyringCall {
+    void (*start)(struct KeyringCall* call);
+    TimedCall* timed;
+    gpointer object; // service, collection or item the call is made on
+    GHashTable* attributes;
+    GList* collections;
+    gchar* text; // alias, path or label
+    gchar** paths;
+    SecretValue* value;
+    gint flags;
+} KeyringCall;
+
+typedef struct {
+    TimedCall* timed;
+    GObject* source;
+    GAsyncResult* result;
+} KeyringResult;
+
+GThread* worker_thread = NULL;
+GMainContext* worker_context = NULL;
+GMainLoop* worker_loop = NULL;
+guint worker_calls = 0; // started, result not delivered yet
+KeyringEvent* keyring_events = NULL; // newest first
+gint keyring_dispatch_pending = 0;
+GMutex keyring_events_lock; // only to wait for events while the unload drains the worker
+GCond keyring_events_cond;
+
+static gboolean dispatch_keyring_events(gpointer data)
+{
+    KeyringEvent* events = NULL;
+    KeyringEvent* ordered = NULL;
+
+    // Cleared first: events pushed from now on schedule the next dispatch
+    g_atomic_int_set(&keyring_dispatch_pending, 0);
+
+    do {
+        events = g_atomic_pointer_get(&keyring_events);
+    } while (!g_atomic_pointer_compare_and_exchange(&keyring_events, events, NULL));
+
+    while (events != NULL) {
+        KeyringEvent* next = events->next;
+        events->next = ordered;
+        ordered = events;
+        events = next;
+    }
+
+    while (ordered != NULL) {
+        KeyringEvent* next = ordered->next;
+        ordered->deliver(ordered->data);
+        g_free(ordered);
+        ordered = next;
+    }
+
+    return FALSE;
+}
+
+// Any thread
+static void post_keyring_event(void (*deliver)(gpointer data), gpointer data)
+{
+    KeyringEvent* event = g_new0(KeyringEvent, 1);
+
+    event->deliver = deliver;
+    event->data = data;
+
+    do {
+        event->next = g_atomic_pointer_get(&keyring_events);
+    } while (!g_atomic_pointer_compare_and_exchange(&keyring_events, event->next, event));
+
+    if (g_atomic_int_compare_and_exchange(&keyring_dispatch_pending, 0, 1))
+        g_idle_add(dispatch_keyring_events, &keyring_events);
+
+    g_mutex_lock(&keyring_events_lock);
+    g_cond_signal(&keyring_events_cond);
+    g_mutex_unlock(&keyring_events_lock);
+}
+
+static gpointer run_keyring_worker(gpointer data)
+{
+    g_main_context_push_thread_default(worker_context);
+    g_main_loop_run(worker_loop);
+    g_main_context_pop_thread_default(worker_context);
+
+    return NULL;
+}
+
+static void start_keyring_worker()
+{
+    worker_context = g_main_context_new();
+    worker_loop = g_main_loop_new(worker_context, FALSE);
+    worker_thread = g_thread_new("purple-gnome-keyring", run_keyring_worker, NULL);
+}
+
+static void join_keyring_worker()
+{
+    purple_debug_info(PLUGIN_ID, "Stopping keyring worker\n");
+
+    g_main_loop_quit(worker_loop);
+    g_thread_join(worker_thread);
+    g_main_loop_unref(worker_loop);
+    g_main_context_unref(worker_context);
+
+    worker_thread = NULL;
+    worker_loop = NULL;
+    worker_context = NULL;
+
+    // Nothing is left to dispatch, the worker is gone
+    g_idle_remove_by_data(&keyring_events);
+    g_atomic_int_set(&keyring_dispatch_pending, 0);
+}
+
+/*
+ * The worker runs code of the plugin, it must be joined before the unload returns: at quit the module is
+ * closed right after. Results of the calls in flight are delivered here instead of by the main loop,
+ * the last writes of the unload get KEYRING_UNLOAD_TIMEOUT before they are cancelled too.
+ */
+static void stop_keyring_worker()
+{
+    gint64 deadline = g_get_monotonic_time() + KEYRING_UNLOAD_TIMEOUT * G_TIME_SPAN_MILLISECOND;
+
+    if (worker_thread == NULL)
+        return;
+
+    while (worker_calls > 0) {
+        g_mutex_lock(&keyring_events_lock);
+        while (g_atomic_pointer_get(&keyring_events) == NULL) {
+            if (!g_cond_wait_until(&keyring_events_cond, &keyring_events_lock, deadline)) {
+                purple_debug_info(PLUGIN_ID, "Cancelling %u keyring calls still in flight\n", worker_calls);
+                g_cancellable_cancel(unload_cancellable);
+                deadline = G_MAXINT64;
+            }
+        }
+        g_mutex_unlock(&keyring_events_lock);
+
+        dispatch_keyring_events(NULL);
+    }
+
+    join_keyring_worker();
+}
+
+static void deliver_keyring_result(gpointer data)
+{
+    KeyringResult* result = (KeyringResult*)data;
+
+    on_timed_call(result->source, result->result, result->timed);
+
+    if (result->source != NULL)
+        g_object_unref(result->source);
+    g_object_unref(result->result);
+    g_free(result);
+
+    worker_calls--;
+}
+
+// Worker thread
+static void on_keyring_call_done(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    KeyringResult* done = g_new0(KeyringResult, 1);
+
+    done->timed = (TimedCall*)user_data;
+    done->source = (source != NULL) ? g_object_ref(source) : NULL;
+    done->result = g_object_ref(result);
+    post_keyring_event(deliver_keyring_result, done);
+}
+
+// Worker thread, libsecret copies what it needs from the arguments before returning
+static gboolean run_keyring_call(gpointer data)
+{
+    KeyringCall* call = (KeyringCall*)data;
+
+    call->start(call);
+
+    if (call->object != NULL)
+        g_object_unref(call->object);
+    if (call->attributes != NULL)
+        g_hash_table_unref(call->attributes);
+    if (call->value != NULL)
+        secret_value_unref(call->value);
+    g_list_free_full(call->collections, g_object_unref);
+    g_strfreev(call->paths);
+    g_free(call->text);
+    g_free(call);
+
+    return FALSE;
+}
+
+static KeyringCall* keyring_call_new(TimedCall* timed, void (*start)(KeyringCall* call), gpointer object)
+{
+    KeyringCall* call = g_new0(KeyringCall, 1);
+
+    call->start = start;
+    call->timed = timed;
+    call->object = (object != NULL) ? g_object_ref(object) : NULL;
+
+    return call;
+}
+
+static void submit_keyring_call(KeyringCall* call)
+{
+    // The default context would run libsecret on the main loop, and no result would ever be counted
+    g_return_if_fail(worker_context != NULL);
+
+    worker_calls++;
+    g_main_context_invoke(worker_context, run_keyring_call, call);
+}
+
+static void start_service_get(KeyringCall* call)
+{
+    secret_service_get(call->flags, call->timed->cancellable, on_keyring_call_done, call->timed);
+}
+
+static void start_collection_for_alias(KeyringCall* call)
+{
+    secret_collection_for_alias(call->object, call->text, call->flags, call->timed->cancellable, on_keyring_call_done, call->timed);
+}
+
+static void start_collection_for_path(KeyringCall* call)
+{
+    secret_collection_new_for_dbus_path(call->object, call->text, call->flags, call->timed->cancellable, on_keyring_call_done, call->timed);
+}
+
+static void start_search(KeyringCall* call)
+{
+    secret_collection_search(call->object, PURPLE_SCHEMA, call->attributes, call->flags, call->timed->cancellable, on_keyring_call_done, call->timed);
+}
+
+static void start_get_secrets(KeyringCall* call)
+{
+    secret_service_get_secrets_for_dbus_paths(call->object, (const gchar**)call->paths, call->timed->cancellable, on_keyring_call_done, call->timed);
+}
+
+static void start_item_create(KeyringCall* call)
+{
+    secret_item_create(call->object, PURPLE_SCHEMA, call->attributes, call->text, call->value, call->flags, call->timed->cancellable, on_keyring_call_done, call->timed);
+}
+
+static void start_item_set_attributes(KeyringCall* call)
+{
+    secret_item_set_attributes(call->object, PURPLE_SCHEMA, call->attributes, call->timed->cancellable, on_keyring_call_done, call->timed);
+}
+
+static void start_item_delete(KeyringCall* call)
+{
+    secret_item_delete(call->object, call->timed->cancellable, on_keyring_call_done, call->timed);
+}
+
+static void start_lock(KeyringCall* call)
+{
+    secret_service_lock(call->object, call->collections, call->timed->cancellable, on_keyring_call_done, call->timed);
+}
+
+static void start_unlock(KeyringCall* call)
+{
+    secret_service_unlock(call->object, call->collections, call->timed->cancellable, on_keyring_call_done, call->timed);
+}
+
+/*
+ * Counterparts of the libsecret calls, the result is passed to on_timed_call on the main loop.
+ * The arguments are referenced or copied until the call was started.
+ */
+static void keyring_service_get(TimedCall* timed, SecretServiceFlags flags)
+{
+    KeyringCall* call = keyring_call_new(timed, start_service_get, NULL);
+
+    call->flags = flags;
+    submit_keyring_call(call);
+}
+
+static void keyring_collection_for_alias(TimedCall* timed, SecretService* service, const gchar* alias, SecretCollectionFlags flags)
+{
+    KeyringCall* call = keyring_call_new(timed, start_collection_for_alias, service);
+
+    call->text = g_strdup(alias);
+    call->flags = flags;
+    submit_keyring_call(call);
+}
+
+static void keyring_collection_for_path(TimedCall* timed, SecretService* service, const gchar* path, SecretCollectionFlags flags)
+{
+    KeyringCall* call = keyring_call_new(timed, start_collection_for_path, service);
+
+    call->text = g_strdup(path);
+    call->flags = flags;
+    submit_keyring_call(call);
+}
+
+static void keyring_search(TimedCall* timed, SecretCollection* collection, GHashTable* attributes, SecretSearchFlags flags)
+{
+    KeyringCall* call = keyring_call_new(timed, start_search, collection);
+
+    // The search may prompt to unlock, like the unlock call it waits for the user without a deadline
+    if ((flags & SECRET_SEARCH_UNLOCK) && (timed->deadline_timer != 0) && secret_collection_get_locked(collection)) {
+        purple_timeout_remove(timed->deadline_timer);
+        timed->deadline_timer = 0;
+    }
+
+    call->attributes = g_hash_table_ref(attributes);
+    call->flags = flags;
+    submit_keyring_call(call);
+}
+
+static void keyring_get_secrets(TimedCall* timed, SecretService* service, const gchar** paths)
+{
+    KeyringCall* call = keyring_call_new(timed, start_get_secrets, service);
+
+    call->paths = g_strdupv((gchar**)paths);
+    submit_keyring_call(call);
+}
+
+static void keyring_item_create(TimedCall* timed, SecretCollection* collection, GHashTable* attributes, const gchar* label, SecretValue* value, SecretItemCreateFlags flags)
+{
+    KeyringCall* call = keyring_call_new(timed, start_item_create, collection);
+
+    call->attributes = g_hash_table_ref(attributes);
+    call->text = g_strdup(label);
+    call->value = secret_value_ref(value);
+    call->flags = flags;
+    submit_keyring_call(call);
+}
+
+static void keyring_item_set_attributes(TimedCall* timed, SecretItem* item, GHashTable* attributes)
+{
+    KeyringCall* call = keyring_call_new(timed, start_item_set_attributes, item);
+
+    call->attributes = g_hash_table_ref(attributes);
+    submit_keyring_call(call);
+}
+
+static void keyring_item_delete(TimedCall* timed, SecretItem* item)
+{
+    submit_keyring_call(keyring_call_new(timed, start_item_delete, item));
+}
+
+static void keyring_lock(TimedCall* timed, SecretService* service, SecretCollection* collection)
+{
+    KeyringCall* call = keyring_call_new(timed, start_lock, service);
+
+    call->collections = g_list_append(NULL, g_object_ref(collection));
+    submit_keyring_call(call);
+}
+
+static void keyring_unlock(TimedCall* timed, SecretService* service, SecretCollection* collection)
+{
+    KeyringCall* call = keyring_call_new(timed, start_unlock, service);
+
+    call->collections = g_list_append(NULL, g_object_ref(collection));
+    submit_keyring_call(call);
+}
+
+/**************************************************
+ **************************************************
+ **************** Startup priority ****************
+ **************************************************
+ **************************************************/
+
+#define PRIORITY_CONNECT_FIRST 0
+#define PRIORITY_NONE G_MAXINT
+
+// Index key -> priority, connect first accounts rank before the recently used ones (lower loads first)
+static GHashTable* load_account_priorities()
+{
+    GHashTable* priorities = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GList* entries = purple_prefs_get_string_list(KEYRING_RECENT_PREF);
+    gint rank = PRIORITY_CONNECT_FIRST + 1;
+
+    for (GList* li = entries; li != NULL; li = li->next) {
+        if (!g_hash_table_contains(priorities, li->data))
+            g_hash_table_insert(priorities, g_strdup(li->data), GINT_TO_POINTER(rank++));
+    }
+    g_list_free_full(entries, g_free);
+
+    entries = purple_prefs_get_string_list(KEYRING_CONNECT_FIRST_PREF);
+    for (GList* li = entries; li != NULL; li = li->next)
+        g_hash_table_replace(priorities, g_strdup(li->data), GINT_TO_POINTER(PRIORITY_CONNECT_FIRST));
+    g_list_free_full(entries, g_free);
+
+    return priorities;
+}
+
+static gint get_account_priority(GHashTable* priorities, PurpleAccount* account)
+{
+    gpointer rank = NULL;
+
+    if (!g_hash_table_lookup_extended(priorities, get_account_context(account)->key, NULL, &rank))
+        return PRIORITY_NONE;
+    return GPOINTER_TO_INT(rank);
+}
+
+static gint compare_account_priority(gconstpointer a, gconstpointer b, gpointer priorities)
+{
+    gint rank_a = get_account_priority(priorities, (PurpleAccount*)a);
+    gint rank_b = get_account_priority(priorities, (PurpleAccount*)b);
+
+    return (rank_a < rank_b) ? -1 : (rank_a > rank_b);
+}
+
+/*
+ * Sort accounts by priority and split off the ones loaded ahead of the others:
+ * all connect first accounts and the KEYRING_PRIORITY_RECENT most recently used ones.
+ * Returns the remaining accounts, accounts is left with the priority ones.
+ */
+static GList* split_priority_accounts(GList** accounts)
+{
+    GHashTable* priorities = load_account_priorities();
+    GList* rest = NULL;
+    guint recent = 0;
+
+    *accounts = g_list_sort_with_data(*accounts, compare_account_priority, priorities);
+
+    for (rest = *accounts; rest != NULL; rest = rest->next) {
+        gint rank = get_account_priority(priorities, rest->data);
+
+        if ((rank == PRIORITY_NONE) || ((rank != PRIORITY_CONNECT_FIRST) && (recent++ >= KEYRING_PRIORITY_RECENT)))
+            break;
+    }
+    g_hash_table_unref(priorities);
+
+    if (rest == *accounts) {
+        *accounts = NULL;
+    } else if (rest != NULL) {
+        rest->prev->next = NULL;
+        rest->prev = NULL;
+    }
+
+    return rest;
+}
+
+// Move the account to the front of the usage history
+static void record_account_usage(AccountContext* context)
+{
+    GList* entries = purple_prefs_get_string_list(KEYRING_RECENT_PREF);
+    GList* recent = NULL;
+    guint count = 1;
+
+    if ((entries != NULL) && (g_strcmp0(entries->data, context->key) == 0)) {
+        g_list_free_full(entries, g_free);
+        return;
+    }
+
+    for (GList* li = entries; li != NULL; li = li->next) {
+        if ((count < KEYRING_RECENT_MAX) && (g_strcmp0(li->data, context->key) != 0)) {
+            recent = g_list_prepend(recent, li->data);
+            count++;
+        } else {
+            g_free(li->data);
+        }
+    }
+    g_list_free(entries);
+
+    recent = g_list_prepend(g_list_reverse(recent), g_strdup(context->key));
+    purple_prefs_set_string_list(KEYRING_RECENT_PREF, recent);
+    g_list_free_full(recent, g_free);
+}
+
+/**************************************************
+ **************************************************
+ **************** Held auto-login *****************
+ **************************************************
+ **************************************************/
+
+// Account the messenger wants to sign on, but that has no password to do so: its password prompt is open
+static gboolean is_waiting_for_password(PurpleAccount* account)
+{
+    PurplePlugin* prpl = purple_find_prpl(purple_account_get_protocol_id(account));
+
+    if ((prpl == NULL) || (PURPLE_PLUGIN_PROTOCOL_INFO(prpl)->options & (OPT_PROTO_NO_PASSWORD | OPT_PROTO_PASSWORD_OPTIONAL)))
+        return FALSE;
+
+    return purple_account_get_enabled(account, purple_core_get_ui())
+        && purple_account_is_disconnected(account)
+        && purple_status_is_online(purple_account_get_active_status(account))
+        && !purple_account_get_remember_password(account)
+        && (purple_account_get_password(account) == NULL);
+}
+
+/*
+ * Close the password prompt of an account until its init password is loaded, its status stays as it is.
+ * Closing a request does not run its callbacks, so the account is neither set offline nor connected.
+ */
+static void hold_account(PurpleAccount* account)
+{
+    AccountContext* context = get_account_context(account);
+
+    if (!is_waiting_for_password(account))
+        return;
+
+    if (!context->held)
+        purple_debug_info(PLUGIN_ID, "Holding %s with username %s until its password is loaded\n", account->protocol_id, account->username);
+    context->held = TRUE;
+    purple_request_close_with_handle(account);
+}
+
+// Init passwords are loaded for all accounts, in on-demand mode only for those that sign on
+static void hold_active_accounts()
+{
+    GList* accounts = purple_accounts_get_all_active();
+
+    for (GList* li = accounts; li != NULL; li = li->next) {
+        if (purple_prefs_get_bool(KEYRING_ON_DEMAND_PREF))
+            load_wanted_password(li->data);
+        else if (!accounts_initialized)
+            hold_account(li->data);
+    }
+    g_list_free(accounts);
+}
+
+// First main loop iteration: the messenger signed on the accounts of the startup status meanwhile
+static gboolean on_startup_sign_on(gpointer data)
+{
+    hold_timer = 0;
+    hold_active_accounts();
+
+    return FALSE;
+}
+
+// Called on load, auto-login ran already if the plugin was loaded later, at startup it runs right after
+static void hold_init_accounts()
+{
+    hold_active_accounts();
+    hold_timer = purple_timeout_add(0, on_startup_sign_on, NULL);
+}
+
+// Sign on a held account, the messenger asks for the password if it is still missing, returns FALSE if it was not held
+static gboolean restore_held_account(PurpleAccount* account)
+{
+    AccountContext* context = get_account_context(account);
+
+    if (!context->held)
+        return FALSE;
+    context->held = FALSE;
+
+    // Unless the user went offline or signed on meanwhile
+    if (!purple_account_get_enabled(account, purple_core_get_ui()) || !purple_account_is_disconnected(account)
+        || !purple_status_is_online(purple_account_get_active_status(account)))
+        return FALSE;
+
+    purple_debug_info(PLUGIN_ID, "Connecting held %s with username %s\n", account->protocol_id, account->username);
+    purple_request_close_with_handle(account);
+    purple_account_connect(account);
+    return TRUE;
+}
+
+// Passwords will not be loaded, e.g. the keyring stayed locked: the messenger asks for them instead
+static void release_held_accounts()
+{
+    for (GList* li = purple_accounts_get_all(); li != NULL; li = li->next) {
+        AccountContext* context = g_hash_table_lookup(account_contexts, li->data);
+
+        if ((context != NULL) && context->held)
+            restore_held_account(li->data);
+    }
+}
+
+// At quit, held accounts are not signed on anymore
+static void forget_held_accounts()
+{
+    GHashTableIter iter;
+    gpointer context;
+
+    g_hash_table_iter_init(&iter, account_contexts);
+    while (g_hash_table_iter_next(&iter, NULL, &context))
+        ((AccountContext*)context)->held = FALSE;
+}
+
+/**************************************************
+ **************************************************
+ *********** Collection initalization *************
+ **************************************************
+ **************************************************/
+// Index all loaded secrets by (protocol, username) and record the item paths of the given accounts
+static GHashTable* build_secret_index(GList* items, GList* accounts)
+{
+    GHashTable* index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, secret_value_unref);
+    GHashTable* keys = g_hash_table_new(g_str_hash, g_str_equal);
+    gboolean paths_changed = FALSE;
+
+    // Items of other profiles sharing the keyring are not ours to remember
+    for (GList* li = accounts; li != NULL; li = li->next)
+        g_hash_table_add(keys, get_account_context(li->data)->key);
+
+    for (GList* li = items; li != NULL; li = li->next) {
+        SecretItem* item = li->data;
+        SecretValue* value = secret_item_get_secret(item);
+
+        if (value == NULL)
+            continue;
+
+        GHashTable* attributes = secret_item_get_attributes(item);
+        const gchar* protocol = g_hash_table_lookup(attributes, "protocol");
+        const gchar* username = g_hash_table_lookup(attributes, "username");
+
+        if ((protocol != NULL) && (username != NULL)) {
+            gchar* key = get_index_key(protocol, username);
+
+            // Keep the first match, like the single account search did
+            if (!g_hash_table_contains(index, key)) {
+                if (g_hash_table_contains(keys, key))
+                    paths_changed |= remember_item_path(key, item);
+                g_hash_table_insert(index, key, secret_value_ref(value));
+            } else {
+                g_free(key);
+            }
+        }
+
+        g_hash_table_unref(attributes);
+        secret_value_unref(value);
+    }
+
+    if (paths_changed)
+        save_item_paths();
+
+    g_hash_table_unref(keys);
+    return index;
+}
+
+// Set the init password (if given) and sign on the account if it was held or auto-login waits for it
+static void release_init_account(PurpleAccount* account, SecretValue* value)
+{
+    if (!g_hash_table_remove(init_pending, account))
+        return;
+
+    // Account may have been removed while loading
+    if (g_list_find(purple_accounts_get_all(), account) == NULL)
+        return;
+
+    if (value != NULL) {
+        purple_debug_info(PLUGIN_ID, "Setting init password for %s with username %s\n", account->protocol_id, account->username);
+        purple_account_set_password(account, secret_value_get_text(value));
+        cache_account_secret(get_account_context(account), value);
+        remember_written_secret(get_account_context(account), secret_value_get_text(value));
+    }
+
+    if (restore_held_account(account))
+        return;
+
+    // Auto-login ran before the password was there and asked the user for it
+    if ((purple_account_get_password(account) != NULL)
+        && purple_account_is_disconnected(account)
+        && purple_status_is_online(purple_account_get_active_status(account))) {
+        purple_debug_info(PLUGIN_ID, "Connecting %s with username %s\n", account->protocol_id, account->username);
+        purple_request_close_with_handle(account);
+        purple_account_connect(account);
+    }
+}
+
+// Accounts whose passwords are loaded together, each is released once its secret is known (NULL if there is none)
+typedef struct {
+    GList* accounts;
+    void (*release)(PurpleAccount* account, SecretValue* value);
+} SecretBatch;
+
+static SecretBatch* secret_batch_new(GList* accounts, void (*release)(PurpleAccount* account, SecretValue* value))
+{
+    SecretBatch* batch = g_new0(SecretBatch, 1);
+
+    count_alloc(LIVE_BATCH);
+    batch->accounts = accounts;
+    batch->release = release;
+    return batch;
+}
+
+static void free_secret_batch(gpointer data)
+{
+    SecretBatch* batch = (SecretBatch*)data;
+
+    g_list_free(batch->accounts);
+    g_free(batch);
+    count_free(LIVE_BATCH);
+}
+
+static void on_batch_items_loaded(GObject* source, GAsyncResult* result, gpointer user_data);
+
+// One search over the whole schema instead of one per account
+static void search_secret_batch(GList* accounts, void (*release)(PurpleAccount* account, SecretValue* value))
+{
+    GHashTable* attributes = secret_attributes_build(PURPLE_SCHEMA, "version", KEYRING_SCHEMA_VERSION, NULL);
+    TimedCall* timed = timed_call_new(OP_SEARCH, NULL, on_batch_items_loaded, secret_batch_new(accounts, release), free_secret_batch);
+
+    purple_debug_info(PLUGIN_ID, "Searching %u passwords\n", g_list_length(accounts));
+    keyring_search(timed, plugin_collection, attributes, SECRET_SEARCH_ALL | SECRET_SEARCH_UNLOCK | SECRET_SEARCH_LOAD_SECRETS);
+
+    g_hash_table_unref(attributes);
+}
+
+// Callback of the schema wide batch search
+static void on_batch_items_loaded(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    SecretBatch* batch = (SecretBatch*)user_data;
+    GHashTable* index = NULL;
+
+    GError* error = NULL;
+    GList* items = secret_collection_search_finish(plugin_collection, result, &error);
+    track_items(items);
+
+    if (error != NULL) {
+        record_operation_error(OP_SEARCH);
+        // Accounts are loaded again once the daemon is back
+        if (is_service_lost(error))
+            lose_secret_service();
+        else
+            dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not read passwords", error->message);
+        g_error_free(error);
+    } else {
+        purple_debug_info(PLUGIN_ID, "Loaded %u init passwords\n", g_list_length(items));
+        index = build_secret_index(items, batch->accounts);
+        g_list_free_full(items, g_object_unref);
+    }
+
+    // Release all accounts in a single pass
+    for (GList* li = batch->accounts; li != NULL; li = li->next) {
+        PurpleAccount* account = li->data;
+        SecretValue* value = NULL;
+
+        if (index != NULL)
+            value = g_hash_table_lookup(index, get_account_context(account)->key);
+
+        if (value == NULL)
+            purple_debug_info(PLUGIN_ID, "%s: Password is empty - no password saved\n", account->protocol_id);
+
+        batch->release(account, value);
+    }
+
+    free_secret_batch(batch);
+
+    if (index != NULL)
+        g_hash_table_unref(index);
+}
+
+// Callback of the batched GetSecrets call on the known item paths
+static void on_batch_secrets_loaded(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    SecretBatch* batch = (SecretBatch*)user_data;
+    GList* missing = NULL;
+
+    GError* error = NULL;
+    GHashTable* secrets = secret_service_get_secrets_for_dbus_paths_finish(SECRET_SERVICE(source), result, &error);
+
+    if (error != NULL) {
+        record_operation_error(OP_GET_SECRETS);
+        purple_debug_info(PLUGIN_ID, "Could not load secrets by path, falling back to search: %s\n", error->message);
+        g_error_free(error);
+    }
+
+    for (GList* li = batch->accounts; li != NULL; li = li->next) {
+        PurpleAccount* account = li->data;
+        AccountContext* context = get_account_context(account);
+        const gchar* path = lookup_account_item_path(context);
+        SecretValue* value = NULL;
+
+        if ((secrets != NULL) && (path != NULL))
+            value = g_hash_table_lookup(secrets, path);
+
+        if (value != NULL) {
+            batch->release(account, value);
+        } else {
+            // Missing or stale path, found by the search below
+            if ((path != NULL) && (secrets != NULL)) {
+                purple_debug_info(PLUGIN_ID, "Stale item path %s for %s\n", path, account->username);
+                forget_account_item_path(context);
+            }
+            missing = g_list_prepend(missing, account);
+        }
+    }
+
+    if ((missing != NULL) && (plugin_collection != NULL)) {
+        search_secret_batch(g_list_reverse(missing), batch->release);
+    } else {
+        // Service went away meanwhile, the load pipeline waits for it
+        for (GList* li = missing; li != NULL; li = li->next)
+            load_account_password(li->data, NULL);
+        g_list_free(missing);
+    }
+
+    free_secret_batch(batch);
+
+    if (secrets != NULL)
+        g_hash_table_unref(secrets);
+}
+
+// Mark accounts as waiting for their init password, they stay enabled
+static gboolean init_account(PurpleAccount* account)
+{
+    if (purple_account_get_remember_password(account))
+        return FALSE;
+
+    purple_debug_info(PLUGIN_ID, "Loading init password %s with username %s\n", account->protocol_id, account->username);
+    g_hash_table_add(init_pending, account);
+
+    return TRUE;
+}
+
+// Load the passwords of accounts with as few keyring calls as possible, the collection must be ready
+static void load_secret_batch(GList* accounts, void (*release)(PurpleAccount* account, SecretValue* value))
+{
+    if (plugin_backend == BACKEND_VAULT) {
+        load_vault_batch(accounts, release);
+        return;
+    }
+
+    GPtrArray* paths = g_ptr_array_new();
+    GList* known = NULL;
+    GList* unknown = NULL;
+
+    for (GList* li = accounts; li != NULL; li = li->next) {
+        const gchar* path = lookup_account_item_path(get_account_context(li->data));
+
+        if (path != NULL) {
+            g_ptr_array_add(paths, (gpointer)path);
+            known = g_list_prepend(known, li->data);
+        } else {
+            unknown = g_list_prepend(unknown, li->data);
+        }
+    }
+    g_list_free(accounts);
+
+    if (known != NULL) {
+        // Known item paths: fetch all their secrets in one GetSecrets call, skip searching
+        purple_debug_info(PLUGIN_ID, "Loading %u passwords by item path\n", paths->len);
+        g_ptr_array_add(paths, NULL);
+
+        TimedCall* timed = timed_call_new(OP_GET_SECRETS, NULL, on_batch_secrets_loaded, secret_batch_new(g_list_reverse(known), release), free_secret_batch);
+        keyring_get_secrets(timed, secret_collection_get_service(plugin_collection), (const gchar**)paths->pdata);
+    }
+
+    // The accounts without a path share one search
+    if (unknown != NULL)
+        search_secret_batch(g_list_reverse(unknown), release);
+
+    g_ptr_array_free(paths, TRUE);
+}
+
+// Load the passwords of all enabled accounts
+static void load_init_passwords()
+{
+    GList* accounts = purple_accounts_get_all_active();
+    GList* pending = NULL;
+    GList* rest = NULL;
+    gboolean first = FALSE;
+
+    // Passwords are loaded once their account connects
+    if (purple_prefs_get_bool(KEYRING_ON_DEMAND_PREF)) {
+        g_list_free(accounts);
+        return;
+    }
+
+    for (GList* li = accounts; li != NULL; li = li->next) {
+        if (init_account(li->data))
+            pending = g_list_prepend(pending, li->data);
+    }
+    g_list_free(accounts);
+
+    if (pending == NULL)
+        return;
+
+    pending = g_list_reverse(pending);
+    rest = split_priority_accounts(&pending);
+
+    for (GList* li = pending; (li != NULL) && !first; li = li->next)
+        first = (lookup_account_item_path(get_account_context(li->data)) != NULL);
+
+    // Priority accounts without a path join the search of the others
+    for (GList* li = pending; first && (li != NULL);) {
+        GList* next = li->next;
+
+        if (lookup_account_item_path(get_account_context(li->data)) == NULL) {
+            pending = g_list_remove_link(pending, li);
+            rest = g_list_concat(li, rest);
+        }
+        li = next;
+    }
+
+    if (first && (rest != NULL)) {
+        // Sent first, so the keyring answers it before the batch of the others
+        purple_debug_info(PLUGIN_ID, "Loading %u priority passwords first\n", g_list_length(pending));
+        load_secret_batch(pending, release_init_account);
+        load_secret_batch(rest, release_init_account);
+    } else {
+        // Without known item paths both batches would search the whole schema
+        load_secret_batch(g_list_concat(pending, rest), release_init_account);
+    }
+}
+
+/**************************************************
+ **************************************************
+ **************** Schema migration ****************
+ **************************************************
+ **************************************************/
+
+// Rewrite of one version 1 item for one account
+typedef struct {
+    SecretItem* item;
+    PurpleAccount* account;
+    SecretValue* value; // NULL: rewrite the attributes of item, else store a copy for an account that shared it
+} MigrationJob;
+
+GQueue migration_jobs = G_QUEUE_INIT;
+guint migration_running = 0;
+guint migration_errors = 0;
+gboolean schema_migrating = FALSE; // pipeline calls wait until the items are migrated
+gboolean schema_migration = TRUE; // the CLI leaves version 1 items to the plugin
+
+static void migration_schedule();
+
+static void free_migration_job(gpointer data)
+{
+    MigrationJob* job = (MigrationJob*)data;
+
+    g_object_unref(job->item);
+    if (job->value != NULL)
+        secret_value_unref(job->value);
+    g_free(job);
+    count_free(LIVE_MIGRATION);
+}
+
+static void finish_schema_migration()
+{
+    schema_migrating = FALSE;
+
+    if (migration_errors == 0) {
+        purple_debug_info(PLUGIN_ID, "Keyring items migrated to schema version %i\n", KEYRING_SCHEMA_VERSION);
+    } else {
+        purple_debug_info(PLUGIN_ID, "%u keyring items could not be migrated, trying again on next start\n", migration_errors);
+    }
+
+    // Otherwise the keyring was lost, a reconnect loads the passwords
+    if (plugin_state == COLLECTION_READY) {
+        load_init_passwords();
+        resume_waiting_calls(NULL);
+    }
+}
+
+static void on_item_migrated(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    MigrationJob* job = (MigrationJob*)user_data;
+    SecretItem* item = job->item;
+    GError* error = NULL;
+
+    if (job->value == NULL) {
+        secret_item_set_attributes_finish(job->item, result, &error);
+    } else {
+        item = secret_item_create_finish(result, &error);
+        track_object(LIVE_ITEM, item);
+    }
+
+    if (error != NULL) {
+        record_operation_error((job->value == NULL) ? OP_SET_ATTRIBUTES : OP_CREATE);
+        migration_errors++;
+        purple_debug_info(PLUGIN_ID, "Could not migrate item of %s: %s\n", job->account->username, error->message);
+        if (is_service_lost(error))
+            lose_secret_service();
+        g_error_free(error);
+    } else if (g_list_find(purple_accounts_get_all(), job->account) != NULL) {
+        remember_account_item_path(get_account_context(job->account), item);
+    }
+
+    if ((job->value != NULL) && (item != NULL))
+        g_object_unref(item);
+
+    free_migration_job(job);
+    migration_running--;
+    migration_schedule();
+}
+
+// Keep up to bulk window rewrites in flight, finish once all are done
+static void migration_schedule()
+{
+    guint window = MAX(purple_prefs_get_int(KEYRING_BULK_WINDOW_PREF), 1);
+    MigrationJob* job = NULL;
+
+    // Keyring is gone, the rest is tried again on next start
+    while ((plugin_state != COLLECTION_READY) && ((job = g_queue_pop_head(&migration_jobs)) != NULL)) {
+        migration_errors++;
+        free_migration_job(job);
+    }
+
+    while ((migration_running < window) && ((job = g_queue_pop_head(&migration_jobs)) != NULL)) {
+        AccountContext* context = get_account_context(job->account);
+        TimedCall* timed = timed_call_new((job->value == NULL) ? OP_SET_ATTRIBUTES : OP_CREATE, NULL, on_item_migrated, job, free_migration_job);
+
+        migration_running++;
+        if (job->value == NULL) {
+            keyring_item_set_attributes(timed, job->item, context->attributes);
+        } else {
+            keyring_item_create(timed, plugin_collection, context->attributes, context->label, job->value, SECRET_ITEM_CREATE_REPLACE);
+        }
+    }
+
+    if ((migration_running == 0) && schema_migrating)
+        finish_schema_migration();
+}
+
+// Number of accounts that read the version 1 item of username so far, without those in current (if given)
+static guint count_legacy_accounts(const gchar* username, GHashTable* current)
+{
+    guint count = 0;
+
+    for (GList* li = purple_accounts_get_all(); li != NULL; li = li->next) {
+        if (g_strcmp0(purple_account_get_username(li->data), username) != 0)
+            continue;
+        if ((current == NULL) || !g_hash_table_contains(current, get_account_context(li->data)->key))
+            count++;
+    }
+
+    return count;
+}
+
+// Version 1 items of a migration, and the index keys that have a current item
+typedef struct {
+    GList* items;
+    GHashTable* current;
+} LegacyItems;
+
+static void free_legacy_items(gpointer data)
+{
+    LegacyItems* legacy = (LegacyItems*)data;
+
+    g_list_free_full(legacy->items, g_object_unref);
+    g_hash_table_destroy(legacy->current);
+    g_free(legacy);
+}
+
+// Version 1 items only know the username, every account with it read the item so far and gets its own now
+static void queue_legacy_item(SecretItem* item, const gchar* username, SecretValue* value, GHashTable* current)
+{
+    gboolean rewritten = FALSE;
+
+    for (GList* li = purple_accounts_get_all(); li != NULL; li = li->next) {
+        PurpleAccount* account = li->data;
+        AccountContext* context = NULL;
+        MigrationJob* job = NULL;
+
+        if (g_strcmp0(purple_account_get_username(account), username) != 0)
+            continue;
+
+        // Migrated by another profile or an earlier start, a rewrite would duplicate it
+        context = get_account_context(account);
+        if (g_hash_table_contains(current, context->key)) {
+            purple_debug_info(PLUGIN_ID, "%s already has a current item\n", context->key);
+            continue;
+        }
+
+        job = g_new0(MigrationJob, 1);
+        count_alloc(LIVE_MIGRATION);
+        job->item = g_object_ref(item);
+        job->account = account;
+
+        if (rewritten) {
+            // Secret of a shared item could not be read, this account keeps asking for its password
+            if (value == NULL) {
+                free_migration_job(job);
+                continue;
+            }
+            job->value = secret_value_ref(value);
+        }
+
+        rewritten = TRUE;
+        g_hash_table_add(current, g_strdup(context->key));
+        g_queue_push_tail(&migration_jobs, job);
+    }
+
+    if (!rewritten)
+        purple_debug_info(PLUGIN_ID, "No account for version 1 item of %s, left in place\n", username);
+}
+
+// Queue the rewrites of all version 1 items, secrets holds the values of the shared ones by item path
+static void queue_legacy_items(LegacyItems* legacy, GHashTable* secrets)
+{
+    for (GList* li = legacy->items; li != NULL; li = li->next) {
+        GHashTable* attributes = secret_item_get_attributes(li->data);
+        SecretValue* value = NULL;
+
+        if (secrets != NULL)
+            value = g_hash_table_lookup(secrets, g_dbus_proxy_get_object_path(G_DBUS_PROXY(li->data)));
+
+        queue_legacy_item(li->data, g_hash_table_lookup(attributes, "username"), value, legacy->current);
+        g_hash_table_unref(attributes);
+    }
+    free_legacy_items(legacy);
+
+    if (!g_queue_is_empty(&migration_jobs))
+        purple_debug_info(PLUGIN_ID, "Migrating %u keyring items to schema version %i\n", g_queue_get_length(&migration_jobs), KEYRING_SCHEMA_VERSION);
+    migration_schedule();
+}
+
+static void on_legacy_secrets_loaded(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    LegacyItems* legacy = (LegacyItems*)user_data;
+    GError* error = NULL;
+    GHashTable* secrets = secret_service_get_secrets_for_dbus_paths_finish(SECRET_SERVICE(source), result, &error);
+
+    if (error != NULL) {
+        record_operation_error(OP_GET_SECRETS);
+        migration_errors++;
+        purple_debug_info(PLUGIN_ID, "Could not read shared keyring items to migrate: %s\n", error->message);
+        if (is_service_lost(error))
+            lose_secret_service();
+        g_error_free(error);
+    }
+
+    queue_legacy_items(legacy, secrets);
+
+    if (secrets != NULL)
+        g_hash_table_unref(secrets);
+}
+
+static void on_legacy_items_loaded(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    GError* error = NULL;
+    GList* items = secret_collection_search_finish(plugin_collection, result, &error);
+    LegacyItems* legacy = g_new0(LegacyItems, 1);
+    GPtrArray* shared = g_ptr_array_new();
+    track_items(items);
+
+    legacy->current = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    if (error != NULL) {
+        record_operation_error(OP_SEARCH);
+        migration_errors++;
+        purple_debug_info(PLUGIN_ID, "Could not search keyring items to migrate: %s\n", error->message);
+        if (is_service_lost(error))
+            lose_secret_service();
+        g_error_free(error);
+    }
+
+    // Accounts with a current item are not migrated again
+    for (GList* li = items; li != NULL; li = li->next) {
+        GHashTable* attributes = secret_item_get_attributes(li->data);
+        const gchar* protocol = g_hash_table_lookup(attributes, "protocol");
+        const gchar* username = g_hash_table_lookup(attributes, "username");
+
+        if (g_hash_table_contains(attributes, "version")) {
+            if ((protocol != NULL) && (username != NULL))
+                g_hash_table_add(legacy->current, get_index_key(protocol, username));
+        } else {
+            legacy->items = g_list_prepend(legacy->items, g_object_ref(li->data));
+        }
+        g_hash_table_unref(attributes);
+    }
+
+    // Only items read by more than one account need their secret, for the copies
+    for (GList* li = legacy->items; li != NULL; li = li->next) {
+        GHashTable* attributes = secret_item_get_attributes(li->data);
+
+        if (count_legacy_accounts(g_hash_table_lookup(attributes, "username"), legacy->current) > 1)
+            g_ptr_array_add(shared, (gpointer)g_dbus_proxy_get_object_path(G_DBUS_PROXY(li->data)));
+        g_hash_table_unref(attributes);
+    }
+
+    if ((shared->len > 0) && (plugin_state == COLLECTION_READY)) {
+        purple_debug_info(PLUGIN_ID, "Reading %u shared keyring items to migrate\n", shared->len);
+        g_ptr_array_add(shared, NULL);
+
+        TimedCall* timed = timed_call_new(OP_GET_SECRETS, NULL, on_legacy_secrets_loaded, legacy, free_legacy_items);
+        keyring_get_secrets(timed, secret_collection_get_service(plugin_collection), (const gchar**)shared->pdata);
+    } else {
+        queue_legacy_items(legacy, NULL);
+    }
+
+    g_ptr_array_free(shared, TRUE);
+    g_list_free_full(items, g_object_unref);
+}
+
+// The keyring tells whether version 1 items are left: one search without secrets, calls wait meanwhile
+static void migrate_schema()
+{
+    purple_debug_info(PLUGIN_ID, "Looking for keyring items older than schema version %i\n", KEYRING_SCHEMA_VERSION);
+    schema_migrating = TRUE;
+    migration_errors = 0;
+
+    GHashTable* attributes = secret_attributes_build(PURPLE_SCHEMA, NULL);
+    TimedCall* timed = timed_call_new(OP_SEARCH, NULL, on_legacy_items_loaded, NULL, NULL);
+
+    keyring_search(timed, plugin_collection, attributes, SECRET_SEARCH_ALL | SECRET_SEARCH_UNLOCK);
+
+    g_hash_table_unref(attributes);
+}
+
+// Running rewrites are abandoned by the unload
+static void cancel_schema_migration()
+{
+    MigrationJob* job = NULL;
+
+    while ((job = g_queue_pop_head(&migration_jobs)) != NULL)
+        free_migration_job(job);
+    migration_running = 0;
+    schema_migrating = FALSE;
+}
+
+static void init_accounts()
+{
+    purple_debug_info(PLUGIN_ID, "Init accounts\n");
+    accounts_initialized = TRUE;
+
+    if (purple_prefs_get_bool(KEYRING_SWEEP_PREF) && (sweep_timer == 0))
+        sweep_timer = purple_timeout_add_seconds(KEYRING_SWEEP_DELAY, sweep_orphans, NULL);
+
+    // The vault always had the current schema
+    if ((plugin_backend == BACKEND_KEYRING) && schema_migration)
+        migrate_schema();
+    else
+        load_init_passwords();
+}
+
+// Use collection as plugin collection, takes ownership of the reference
+static void set_plugin_collection(SecretCollection* collection)
+{
+    if ((collection != NULL) && (collection == plugin_collection)) {
+        g_object_unref(collection);
+        return;
+    }
+
+    g_clear_object(&plugin_collection);
+    plugin_collection = collection;
+
+    if (collection != NULL)
+        forget_foreign_item_paths(collection);
+}
+
+// Continue the calls that waited for the collection, or fail them with error
+static void resume_waiting_calls(const GError* error)
+{
+    GQueue waiters = waiting_calls;
+    PipelineCall* call = NULL;
+
+    g_queue_init(&waiting_calls);
+
+    if (!g_queue_is_empty(&waiters))
+        purple_debug_info(PLUGIN_ID, "Resuming %u waiting calls\n", g_queue_get_length(&waiters));
+
+    while ((call = g_queue_pop_head(&waiters)) != NULL) {
+        if (error != NULL)
+            pipeline_call_finish(call, NULL, g_error_copy(error));
+        else
+            call->run(call);
+    }
+}
+
+// Calls queued while the collection was not ready run in one burst once it is
+static void set_collection_state(collection_state state)
+{
+    if (state == plugin_state)
+        return;
+
+    purple_debug_info(PLUGIN_ID, "Collection state %i -> %i\n", plugin_state, state);
+    plugin_state = state;
+
+    if ((state == COLLECTION_READY) && !schema_migrating)
+        resume_waiting_calls(NULL);
+}
+
+// Callback to lock collection
+static void on_collection_locked(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+
+    GError* error = NULL;
+    GList* locked_collections = NULL;
+
+    secret_service_lock_finish(SECRET_SERVICE(source),
+        result,
+        &locked_collections,
+        &error);
+
+    if (error != NULL) {
+        record_operation_error(OP_LOCK);
+        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not lock Gnome Keyring.", error->message);
+        g_error_free(error);
+    } else if (locked_collections != NULL) {
+        purple_debug_info(PLUGIN_ID, "Successfully locked collection\n");
+        set_plugin_collection(locked_collections->data);
+        set_collection_state(COLLECTION_LOCKED);
+        g_list_free(locked_collections);
+    }
+}
+
+// lock collection
+static gboolean lock_collection()
+{
+    gboolean was_unlocked = FALSE;
+    purple_debug_info(PLUGIN_ID, "Locking collection\n");
+
+    if ((plugin_collection != NULL) && (plugin_state == COLLECTION_READY)) {
+        was_unlocked = TRUE;
+
+        TimedCall* timed = timed_call_new(OP_LOCK, NULL, on_collection_locked, NULL, NULL);
+        keyring_lock(timed, secret_collection_get_service(plugin_collection), plugin_collection);
+
+    } else {
+        purple_debug_info(PLUGIN_ID, "Collection already locked\n");
+    }
+
+    return was_unlocked;
+}
+
+// Callback to unlock collection
+static void on_collection_unlocked(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+
+    GError* error = NULL;
+    GList* unlocked_collections = NULL;
+    gboolean init = unlock_init;
+
+    unlock_init = FALSE;
+
+    secret_service_unlock_finish(SECRET_SERVICE(source),
+        result,
+        &unlocked_collections,
+        &error);
+
+    if ((error != NULL) && is_service_lost(error)) {
+        // Waiting calls stay queued, the restarted daemon is asked again
+        record_operation_error(OP_UNLOCK);
+        unlock_init = init;
+        g_error_free(error);
+        lose_secret_service();
+        return;
+    } else if (error != NULL) {
+        record_operation_error(OP_UNLOCK);
+        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not unlock Gnome Keyring.", error->message);
+    } else if (unlocked_collections != NULL) {
+        purple_debug_info(PLUGIN_ID, "Successfully unlocked collection\n");
+
+        set_plugin_collection(unlocked_collections->data);
+        if (init)
+            init_accounts();
+        set_collection_state(COLLECTION_READY);
+
+        g_list_free(unlocked_collections);
+    } else {
+        // Unlock prompt was dismissed
+        error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Keyring was not unlocked");
+    }
+
+    if (error != NULL) {
+        // Next call asks again
+        set_collection_state(COLLECTION_LOCKED);
+        resume_waiting_calls(error);
+        g_error_free(error);
+        if (init)
+            release_held_accounts();
+    }
+}
+
+// Single unlock of the plugin collection, shared by everything that waits for it
+static void request_unlock()
+{
+    if ((plugin_state == COLLECTION_LOCKED) && (plugin_backend == BACKEND_VAULT)) {
+        request_vault_passphrase();
+        return;
+    }
+
+    if ((plugin_state != COLLECTION_LOCKED) || (plugin_collection == NULL))
+        return;
+
+    purple_debug_info(PLUGIN_ID, "Unlocking collection\n");
+    set_collection_state(COLLECTION_UNLOCKING);
+
+    TimedCall* timed = timed_call_new(OP_UNLOCK, NULL, on_collection_unlocked, NULL, NULL);
+    keyring_unlock(timed, secret_collection_get_service(plugin_collection), plugin_collection);
+}
+
+// Run a pipeline call, or queue it until the collection is resolved and unlocked
+static void run_pipeline_call(PipelineCall* call)
+{
+    if ((plugin_state == COLLECTION_READY) && !schema_migrating) {
+        call->run(call);
+        return;
+    }
+
+    purple_debug_info(PLUGIN_ID, "Collection not ready, queueing call for %s\n", call->context->username);
+    g_queue_push_tail(&waiting_calls, call);
+
+    if (plugin_state == COLLECTION_LOCKED)
+        request_unlock();
+}
+
+// Use collection as plugin collection and unlock it, takes ownership of the collection reference
+static gboolean unlock_collection(SecretCollection* collection, gpointer status)
+{
+    purple_debug_info(PLUGIN_ID, "Unlocking collection (if necessary)\n");
+
+    if (collection == NULL)
+        return FALSE;
+
+    set_plugin_collection(collection);
+
+    if (!secret_collection_get_locked(plugin_collection)) {
+        purple_debug_info(PLUGIN_ID, "Collection already unlocked\n");
+        if (GPOINTER_TO_INT(status) == INITIALIZING)
+            init_accounts();
+        set_collection_state(COLLECTION_READY);
+        return FALSE;
+    }
+
+    unlock_init |= (GPOINTER_TO_INT(status) == INITIALIZING);
+    if (plugin_state != COLLECTION_UNLOCKING)
+        set_collection_state(COLLECTION_LOCKED);
+    request_unlock();
+
+    return TRUE;
+}
+
+// Status to unlock a newly resolved collection with, accounts are initialized once
+static gpointer get_collection_status()
+{
+    return GINT_TO_POINTER(accounts_initialized ? LOADED : INITIALIZING);
+}
+
+// Eager init loads the items of the keyring with it
+static SecretCollectionFlags get_collection_flags()
+{
+    return purple_prefs_get_bool(KEYRING_LAZY_INIT_PREF) ? SECRET_COLLECTION_NONE : SECRET_COLLECTION_LOAD_ITEMS;
+}
+
+// Remember the D-Bus path of the custom keyring for the next start
+static void save_collection_path(SecretCollection* collection)
+{
+    purple_prefs_set_string(KEYRING_COLLECTION_PATH_PREF, g_dbus_proxy_get_object_path(G_DBUS_PROXY(collection)));
+}
+
+static gboolean is_custom_collection(SecretCollection* collection)
+{
+    gchar* label = secret_collection_get_label(collection);
+    gboolean found = (g_strcmp0(label, purple_prefs_get_string(KEYRING_NAME_PREF)) == 0);
+
+    g_free(label);
+    return found;
+}
+
+// Load alias collection callback
+static void on_got_alias_collection(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+
+    GError* error = NULL;
+    SecretCollection* collection = secret_collection_for_alias_finish(result, &error);
+    track_object(LIVE_COLLECTION, collection);
+
+    if (error != NULL) {
+        record_operation_error(OP_COLLECTION);
+        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not load collection.", error->message);
+        g_error_free(error);
+        release_held_accounts();
+    } else if (collection != NULL) {
+        purple_debug_info(PLUGIN_ID, "Successfully loaded default collection\n");
+        unlock_collection(collection, get_collection_status());
+    } else
+        purple_debug_info(PLUGIN_ID, "No collection received - load collections first\n");
+}
+
+// Label lookup over the collection paths of the service, without loading any items
+typedef struct {
+    SecretService* service;
+    GVariant* variant;
+    const gchar** paths;
+    guint next;
+    gpointer status;
+} CollectionLookup;
+
+static void lookup_next_collection(CollectionLookup* lookup);
+
+static void free_collection_lookup(CollectionLookup* lookup)
+{
+    g_free(lookup->paths);
+    g_variant_unref(lookup->variant);
+    g_object_unref(lookup->service);
+    g_free(lookup);
+    count_free(LIVE_LOOKUP);
+}
+
+static void on_lookup_collection(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    CollectionLookup* lookup = (CollectionLookup*)user_data;
+
+    GError* error = NULL;
+    SecretCollection* collection = secret_collection_new_for_dbus_path_finish(result, &error);
+    track_object(LIVE_COLLECTION, collection);
+
+    if (error != NULL) {
+        record_operation_error(OP_COLLECTION);
+        purple_debug_info(PLUGIN_ID, "Could not load collection %s: %s\n", lookup->paths[lookup->next], error->message);
+        g_error_free(error);
+    } else if (is_custom_collection(collection)) {
+        purple_debug_info(PLUGIN_ID, "Determine collection by name: %s\n", purple_prefs_get_string(KEYRING_NAME_PREF));
+        save_collection_path(collection);
+        unlock_collection(collection, lookup->status);
+        free_collection_lookup(lookup);
+        return;
+    } else {
+        g_object_unref(collection);
+    }
+
+    lookup->next++;
+    lookup_next_collection(lookup);
+}
+
+static void lookup_next_collection(CollectionLookup* lookup)
+{
+    if (lookup->paths[lookup->next] == NULL) {
+        // Only complain at startup, the keyring may still get created
+        if (GPOINTER_TO_INT(lookup->status) == INITIALIZING) {
+            dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not find keyring.", purple_prefs_get_string(KEYRING_NAME_PREF));
+            release_held_accounts();
+        }
+        purple_debug_info(PLUGIN_ID, "No keyring named %s\n", purple_prefs_get_string(KEYRING_NAME_PREF));
+        free_collection_lookup(lookup);
+        return;
+    }
+
+    TimedCall* timed = timed_call_new(OP_COLLECTION, NULL, on_lookup_collection, lookup, (GDestroyNotify)free_collection_lookup);
+    keyring_collection_for_path(timed, lookup->service, lookup->paths[lookup->next], get_collection_flags());
+}
+
+// Find the custom keyring by its label without creating proxies for all items
+static void lookup_collection_by_name(SecretService* service, gpointer status)
+{
+    GVariant* variant = g_dbus_proxy_get_cached_property(G_DBUS_PROXY(service), "Collections");
+
+    if (variant == NULL) {
+        purple_debug_info(PLUGIN_ID, "Could not load keyrings. Check if DBus in running!\n");
+        return;
+    }
+
+    CollectionLookup* lookup = g_new0(CollectionLookup, 1);
+    count_alloc(LIVE_LOOKUP);
+    lookup->service = g_object_ref(service);
+    lookup->variant = variant;
+    lookup->paths = g_variant_get_objv(variant, NULL);
+    lookup->status = status;
+
+    lookup_next_collection(lookup);
+}
+
+// Open the keyring at the path saved on the last start, check it still has the right name
+static void on_got_cached_collection(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    SecretService* service = SECRET_SERVICE(user_data);
+
+    GError* error = NULL;
+    SecretCollection* collection = secret_collection_new_for_dbus_path_finish(result, &error);
+    track_object(LIVE_COLLECTION, collection);
+
+    if (error != NULL) {
+        record_operation_error(OP_COLLECTION);
+        purple_debug_info(PLUGIN_ID, "Saved keyring path is stale: %s\n", error->message);
+        g_error_free(error);
+    } else if (is_custom_collection(collection)) {
+        purple_debug_info(PLUGIN_ID, "Opened keyring %s by saved path\n", purple_prefs_get_string(KEYRING_NAME_PREF));
+        unlock_collection(collection, get_collection_status());
+        g_object_unref(service);
+        return;
+    } else {
+        purple_debug_info(PLUGIN_ID, "Saved keyring path belongs to another keyring\n");
+        g_object_unref(collection);
+    }
+
+    purple_prefs_set_string(KEYRING_COLLECTION_PATH_PREF, KEYRING_COLLECTION_PATH_DEFAULT);
+    lookup_collection_by_name(service, get_collection_status());
+    g_object_unref(service);
+}
+
+static void open_custom_collection(SecretService* service)
+{
+    const gchar* path = purple_prefs_get_string(KEYRING_COLLECTION_PATH_PREF);
+
+    if ((path == NULL) || (*path == '\0')) {
+        lookup_collection_by_name(service, get_collection_status());
+        return;
+    }
+
+    TimedCall* timed = timed_call_new(OP_COLLECTION, NULL, on_got_cached_collection, g_object_ref(service), g_object_unref);
+    keyring_collection_for_path(timed, service, path, get_collection_flags());
+}
+
+// Determine and load correct keyring
+static void init_collection(SecretService* service)
+{
+
+    purple_debug_info(PLUGIN_ID, "Initializing secret collection\n");
+
+    g_free(resolved_keyring);
+    resolved_keyring = purple_prefs_get_bool(KEYRING_CUSTOM_NAME_PREF) ? g_strdup(purple_prefs_get_string(KEYRING_NAME_PREF)) : NULL;
+
+    // Check if user defined a different collection name (not the alias default)
+    if (resolved_keyring != NULL) {
+        open_custom_collection(service);
+    } else {
+        purple_debug_info(PLUGIN_ID, "Loading default (alias) collection\n");
+        // Only purple items are ever needed, searches create their proxies
+        TimedCall* timed = timed_call_new(OP_COLLECTION, NULL, on_got_alias_collection, NULL, NULL);
+        keyring_collection_for_alias(timed, service, SECRET_COLLECTION_DEFAULT, get_collection_flags());
+    }
+}
+
+// Check a created or changed collection, adopt it if it is the configured keyring
+static void on_got_signaled_collection(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    GError* error = NULL;
+    SecretCollection* collection = secret_collection_new_for_dbus_path_finish(result, &error);
+    track_object(LIVE_COLLECTION, collection);
+
+    if (error != NULL) {
+        record_operation_error(OP_COLLECTION);
+        g_error_free(error);
+        return;
+    }
+
+    const gchar* path = g_dbus_proxy_get_object_path(G_DBUS_PROXY(collection));
+
+    // Locked or unlocked by someone else, e.g. the screen lock
+    if ((plugin_collection != NULL) && (plugin_state != COLLECTION_UNLOCKING)
+        && (g_strcmp0(path, g_dbus_proxy_get_object_path(G_DBUS_PROXY(plugin_collection))) == 0))
+        set_collection_state(secret_collection_get_locked(collection) ? COLLECTION_LOCKED : COLLECTION_READY);
+
+    if (!purple_prefs_get_bool(KEYRING_CUSTOM_NAME_PREF)) {
+        g_object_unref(collection);
+    } else if (!is_custom_collection(collection)) {
+        // Renamed away from the configured name, another keyring may carry it now
+        if (g_strcmp0(path, purple_prefs_get_string(KEYRING_COLLECTION_PATH_PREF)) == 0)
+            purple_prefs_set_string(KEYRING_COLLECTION_PATH_PREF, KEYRING_COLLECTION_PATH_DEFAULT);
+
+        if ((plugin_collection != NULL) && (g_strcmp0(path, g_dbus_proxy_get_object_path(G_DBUS_PROXY(plugin_collection))) == 0)) {
+            purple_debug_info(PLUGIN_ID, "Keyring %s was renamed\n", purple_prefs_get_string(KEYRING_NAME_PREF));
+            set_plugin_collection(NULL);
+            set_collection_state(COLLECTION_PENDING);
+            if (plugin_service != NULL)
+                lookup_collection_by_name(plugin_service, get_collection_status());
+        }
+        g_object_unref(collection);
+    } else if (plugin_collection == NULL) {
+        purple_debug_info(PLUGIN_ID, "Keyring %s appeared\n", purple_prefs_get_string(KEYRING_NAME_PREF));
+        save_collection_path(collection);
+        unlock_collection(collection, get_collection_status());
+    } else {
+        save_collection_path(collection);
+        g_object_unref(collection);
+    }
+}
+
+// Keep the custom keyring mapping and the lock state up to date
+static void on_service_signal(GDBusProxy* proxy,
+    gchar* sender_name,
+    gchar* signal_name,
+    GVariant* parameters,
+    gpointer user_data)
+{
+    const gchar* path = NULL;
+    gboolean custom = purple_prefs_get_bool(KEYRING_CUSTOM_NAME_PREF);
+
+    if ((g_strcmp0(signal_name, "CollectionCreated") != 0)
+        && (g_strcmp0(signal_name, "CollectionDeleted") != 0)
+        && (g_strcmp0(signal_name, "CollectionChanged") != 0))
+        return;
+
+    g_variant_get(parameters, "(&o)", &path);
+    purple_debug_info(PLUGIN_ID, "%s: %s\n", signal_name, path);
+
+    if (g_strcmp0(signal_name, "CollectionDeleted") == 0) {
+        if (custom && (g_strcmp0(path, purple_prefs_get_string(KEYRING_COLLECTION_PATH_PREF)) == 0))
+            purple_prefs_set_string(KEYRING_COLLECTION_PATH_PREF, KEYRING_COLLECTION_PATH_DEFAULT);
+
+        if ((plugin_collection != NULL) && (g_strcmp0(path, g_dbus_proxy_get_object_path(G_DBUS_PROXY(plugin_collection))) == 0)) {
+            purple_debug_info(PLUGIN_ID, "Keyring %s was deleted\n", purple_prefs_get_string(KEYRING_NAME_PREF));
+            set_plugin_collection(NULL);
+            set_collection_state(COLLECTION_PENDING);
+        }
+        return;
+    }
+
+    // Only the lock state of the default keyring matters
+    if (!custom && ((plugin_collection == NULL) || (g_strcmp0(path, g_dbus_proxy_get_object_path(G_DBUS_PROXY(plugin_collection))) != 0)))
+        return;
+
+    TimedCall* timed = timed_call_new(OP_COLLECTION, NULL, on_got_signaled_collection, NULL, NULL);
+    keyring_collection_for_path(timed, SECRET_SERVICE(proxy), path, SECRET_COLLECTION_NONE);
+}
+
+typedef struct {
+    GDBusProxy* proxy;
+    gchar* sender_name;
+    gchar* signal_name;
+    GVariant* parameters;
+} ServiceSignal;
+
+static void deliver_service_signal(gpointer data)
+{
+    ServiceSignal* signal = (ServiceSignal*)data;
+
+    // Service of a lost daemon or of the last load
+    if ((plugin_service != NULL) && (signal->proxy == G_DBUS_PROXY(plugin_service)))
+        on_service_signal(signal->proxy, signal->sender_name, signal->signal_name, signal->parameters, NULL);
+
+    g_object_unref(signal->proxy);
+    g_free(signal->sender_name);
+    g_free(signal->signal_name);
+    g_variant_unref(signal->parameters);
+    g_free(signal);
+}
+
+// Worker thread, the service proxy was created there and emits its signals there
+static void forward_service_signal(GDBusProxy* proxy,
+    gchar* sender_name,
+    gchar* signal_name,
+    GVariant* parameters,
+    gpointer user_data)
+{
+    ServiceSignal* signal = g_new0(ServiceSignal, 1);
+
+    signal->proxy = g_object_ref(proxy);
+    signal->sender_name = g_strdup(sender_name);
+    signal->signal_name = g_strdup(signal_name);
+    signal->parameters = g_variant_ref(parameters);
+    post_keyring_event(deliver_service_signal, signal);
+}
+
+// Resolve the keyring again after its name was changed in the preferences
+static gboolean resolve_collection(gpointer data)
+{
+    resolve_collection_timer = 0;
+
+    if (plugin_service != NULL)
+        init_collection(plugin_service);
+
+    return FALSE;
+}
+
+static void keyring_name_changed(const char* name, PurplePrefType type, gconstpointer val, gpointer data)
+{
+    const gchar* keyring = purple_prefs_get_bool(KEYRING_CUSTOM_NAME_PREF) ? purple_prefs_get_string(KEYRING_NAME_PREF) : NULL;
+
+    purple_debug_info(PLUGIN_ID, "Keyring pref changed: %s\n", name);
+
+    // E.g. only the name of an unused custom keyring was edited, or an edit was undone
+    if (g_strcmp0(keyring, resolved_keyring) == 0) {
+        if (resolve_collection_timer != 0) {
+            purple_timeout_remove(resolve_collection_timer);
+            resolve_collection_timer = 0;
+        }
+        return;
+    }
+
+    // Item paths of the previous keyring are dropped once another one is adopted
+    purple_prefs_set_string(KEYRING_COLLECTION_PATH_PREF, KEYRING_COLLECTION_PATH_DEFAULT);
+
+    // Debounced, the name entry changes the pref on every key press
+    if (resolve_collection_timer != 0)
+        purple_timeout_remove(resolve_collection_timer);
+    resolve_collection_timer = purple_timeout_add(KEYRING_RESOLVE_DELAY, resolve_collection, NULL);
+}
+
+// Load the passwords of disconnected accounts that have none, e.g. because their init load failed with the lost daemon
+static void rewarm_accounts()
+{
+    GList* accounts = purple_accounts_get_all_active();
+
+    for (GList* li = accounts; li != NULL; li = li->next) {
+        PurpleAccount* account = li->data;
+
+        // Signed on accounts had their password cleared on purpose
+        if (purple_account_get_remember_password(account) || (purple_account_get_password(account) != NULL)
+            || !purple_account_is_disconnected(account))
+            continue;
+
+        // Connected by release_init_account once the password is there
+        g_hash_table_add(init_pending, account);
+        load_account_password(account, NULL);
+    }
+    g_list_free(accounts);
+}
+
+// Get service callback
+static void on_got_service(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+
+    GError* error = NULL;
     SecretService* service = secret_service_get_finish(result, &error);
 
+    if (GPOINTER_TO_UINT(user_data) != service_generation) {
+        // Daemon was lost again meanwhile, a newer request is running
+        purple_debug_info(PLUGIN_ID, "Dropping service of a lost keyring daemon\n");
+        if (service != NULL)
+            g_object_unref(service);
+        g_clear_error(&error);
+    } else if (error != NULL) {
+        record_operation_error(OP_SERVICE);
+        // Try again when the daemon shows up on the bus
+        secrets_lost = TRUE;
+        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not connect to the Gnome Keyring.", error->message);
+        g_error_free(error);
+        release_held_accounts();
+    } else if (service == NULL) {
+        purple_debug_info(PLUGIN_ID, "No service detected\n");
+    } else {
+        purple_debug_info(PLUGIN_ID, "Successfully initialized secret service\n");
+
+        plugin_service = service;
+        service_signal_handler = g_signal_connect(service, "g-signal", G_CALLBACK(forward_service_signal), NULL);
+
+        // Reconnected, the loads wait for the collection like any other call
+        if (accounts_initialized && !purple_prefs_get_bool(KEYRING_ON_DEMAND_PREF))
+            rewarm_accounts();
+
+        init_collection(service);
+    }
+}
+
+// Opened service callback
+/* static void on_service_opened(GObject* source, */
+/*         GAsyncResult* result, */
+/*         gpointer user_data) */
+/* { */
+
+/*     GError* error           = NULL; */
+/*     SecretService* service  = secret_service_open_finish(result, &error); */
+
+/*     if(error != NULL) */
+/*     { */
+/*         dialog( PURPLE_NOTIFY_MSG_ERROR, "Could not connect to the Gnome Keyring.", error->message); */
+/*         g_error_free(error); */
+/*     } */
+/*     else if (service == NULL) */
+/*     { */
+/*         purple_debug_info(PLUGIN_ID, "No service detected\n" ); */
+/*     } */
+/*     else */
+/*     { */
+/*         purple_debug_info(PLUGIN_ID, "Successfully initialized secret service\n" ); */
+/*         init_collection(service); */
+/*         g_object_unref(service); */
+/*     } */
+
+/* } */
+
+// Init collection
+static void init_secret_service()
+{
+    purple_debug_info(PLUGIN_ID, "Initializing secret service\n");
+    SecretServiceFlags flags = SECRET_SERVICE_OPEN_SESSION;
+
+    // Loading the collections also creates a proxy for every item in them
+    if (!purple_prefs_get_bool(KEYRING_LAZY_INIT_PREF))
+        flags |= SECRET_SERVICE_LOAD_COLLECTIONS;
+
+    TimedCall* timed = timed_call_new(OP_SERVICE, NULL, on_got_service, GUINT_TO_POINTER(service_generation), NULL);
+    keyring_service_get(timed, flags);
+    /* secret_service_open(SECRET_TYPE_SERVICE, */
+    /*         NULL, */
+    /*         SECRET_SERVICE_OPEN_SESSION | SECRET_SERVICE_LOAD_COLLECTIONS, */
+    /*         NULL, /1* GCancellable, *1/ */
+    /*         on_service_opened, */
+    /*         NULL); */
+}
+
+/* End of collection functions */
+
+/**************************************************
+ **************************************************
+ ************** Service reconnection **************
+ **************************************************
+ **************************************************/
+
+static void reconnect_secret_service()
+{
+    purple_debug_info(PLUGIN_ID, "Reconnecting to the keyring daemon\n");
+    secrets_lost = FALSE;
+    init_secret_service();
+}
+
+// Drop the service and collection of a keyring daemon that went away, calls wait until it is back
+static void lose_secret_service()
+{
+    if (secrets_lost)
+        return;
+
+    purple_debug_info(PLUGIN_ID, "Lost the keyring daemon\n");
+    secrets_lost = TRUE;
+    service_generation++;
+
+    if (resolve_collection_timer != 0) {
+        purple_timeout_remove(resolve_collection_timer);
+        resolve_collection_timer = 0;
+    }
+
+    set_plugin_collection(NULL);
+    set_collection_state(COLLECTION_PENDING);
+
+    if (plugin_service != NULL) {
+        g_signal_handler_disconnect(plugin_service, service_signal_handler);
+        g_clear_object(&plugin_service);
+    }
+    // The singleton keeps the session of the old daemon
+    secret_service_disconnect();
+
+    // Still owned, e.g. the name moved to a new daemon before its vanish was seen
+    if (secrets_owner != NULL)
+        reconnect_secret_service();
+}
+
+static void on_secrets_appeared(GDBusConnection* connection,
+    const gchar* name,
+    const gchar* owner,
+    gpointer user_data)
+{
+    gboolean restarted = (secrets_owner != NULL) && (g_strcmp0(owner, secrets_owner) != 0);
+
+    purple_debug_info(PLUGIN_ID, "%s is owned by %s\n", name, owner);
+    g_free(secrets_owner);
+    secrets_owner = g_strdup(owner);
+
+    if (restarted)
+        lose_secret_service();
+    else if (secrets_lost)
+        reconnect_secret_service();
+}
+
+static void on_secrets_vanished(GDBusConnection* connection,
+    const gchar* name,
+    gpointer user_data)
+{
+    // Not running yet, the first service request starts it
+    if (secrets_owner == NULL)
+        return;
+
+    purple_debug_info(PLUGIN_ID, "%s vanished\n", name);
+    g_clear_pointer(&secrets_owner, g_free);
+    lose_secret_service();
+}
+
+// Follow NameOwnerChanged of the Secret Service, so a restarted keyring daemon is picked up
+static void watch_secret_service()
+{
+    secrets_watch = g_bus_watch_name(G_BUS_TYPE_SESSION,
+        KEYRING_BUS_NAME,
+        G_BUS_NAME_WATCHER_FLAGS_NONE,
+        on_secrets_appeared,
+        on_secrets_vanished,
+        NULL,
+        NULL);
+}
+
+/**************************************************
+ **************************************************
+ **************** Encrypted vault *****************
+ **************************************************
+ **************************************************/
+/*
+ * Password file for systems without a Secret Service, e.g. headless Finch.
+ *
+ *   header:  magic[8] version iterations salt[16] count records_length check[32]
+ *   index:   count * { hash[8] offset length }, sorted by hash
+ *   records: nonce[12] ciphertext tag[16] each, the plaintext is index key '\0' password
+ *   mac[32]: over everything before
+ *
+ * Integers are little endian. A master key is derived from the passphrase with PBKDF2-SHA256
+ * and split into the encryption, authentication and index keys with HMAC-SHA256. Every record
+ * is encrypted on its own with AES-256-GCM (libgcrypt), its hash is the associated data.
+ * The hashes of the index are keyed, the index does not reveal the accounts.
+ *
+ * The file is mapped and authenticated by the unlock, a lookup searches the mapped index and
+ * decrypts only its record. Changes are written behind as a new file, the unchanged records
+ * are copied without decrypting them.
+ */
+
+#define VAULT_MAGIC "PGKVAULT"
+#define VAULT_VERSION 2
+#define VAULT_KEY_SIZE 32 // SHA-256 output, also the size of the MAC and the check value
+#define VAULT_SALT_SIZE 16
+#define VAULT_NONCE_SIZE 12
+#define VAULT_TAG_SIZE 16
+#define VAULT_HEADER_SIZE (8 + 4 + 4 + VAULT_SALT_SIZE + 4 + 4 + VAULT_KEY_SIZE)
+#define VAULT_ENTRY_SIZE 16
+#define VAULT_CHECK "purple-gnome-keyring vault" // authenticated to tell a wrong passphrase from a damaged file
+#define VAULT_MIN_ITERATIONS 1000 // PBKDF2 rounds accepted from a file, it is only authenticated after deriving
+#define VAULT_MAX_ITERATIONS 10000000
+
+// Derived keys, in the order they are stored in Vault.keys
+typedef enum { VAULT_ENCRYPT_KEY = 0,
+    VAULT_AUTH_KEY = 1,
+    VAULT_INDEX_KEY = 2,
+    VAULT_KEY_COUNT = 3 } vault_key_type;
+
+typedef struct {
+    guint64 hash;
+    guint32 offset;
+    guint32 length;
+} VaultEntry;
+
+typedef struct {
+    gchar* path;
+    GMappedFile* mapped; // NULL until a new vault is written
+    const guchar* index; // inside the mapping
+    guint32 count;
+    const guchar* records; // encrypted records, inside the mapping
+    guint32 records_length;
+    guint32 iterations;
+    guchar salt[VAULT_SALT_SIZE];
+    SecretValue* keys; // derived keys, in locked memory
+    GHashTable* changes; // index key -> SecretValue (NULL if deleted), not written yet
+    guint write_timer;
+} Vault;
+
+Vault* vault = NULL;
+
+static void put_uint32(guchar* data, guint32 value)
+{
+    value = GUINT32_TO_LE(value);
+    memcpy(data, &value, sizeof(value));
+}
+
+static guint32 get_uint32(const guchar* data)
+{
+    guint32 value;
+    memcpy(&value, data, sizeof(value));
+    return GUINT32_FROM_LE(value);
+}
+
+static void put_uint64(guchar* data, guint64 value)
+{
+    value = GUINT64_TO_LE(value);
+    memcpy(data, &value, sizeof(value));
+}
+
+static guint64 get_uint64(const guchar* data)
+{
+    guint64 value;
+    memcpy(&value, data, sizeof(value));
+    return GUINT64_FROM_LE(value);
+}
+
+// Compare without leaking the position of the first difference
+static gboolean equal_digests(const guchar* a, const guchar* b)
+{
+    guchar diff = 0;
+
+    for (guint i = 0; i < VAULT_KEY_SIZE; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+// libsecret initializes libgcrypt only when it needs it, the vault may come first
+static void init_gcrypt()
+{
+    if (gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P))
+        return;
+
+    gcry_check_version(NULL);
+    gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+}
+
+static const guchar* get_vault_key(Vault* v, vault_key_type type)
+{
+    return (const guchar*)secret_value_get(v->keys, NULL) + type * VAULT_KEY_SIZE;
+}
+
+static void vault_hmac(const guchar* key, const guchar* data, gsize length, guchar* digest)
+{
+    GHmac* hmac = g_hmac_new(G_CHECKSUM_SHA256, key, VAULT_KEY_SIZE);
+    gsize size = VAULT_KEY_SIZE;
+
+    g_hmac_update(hmac, data, length);
+    g_hmac_get_digest(hmac, digest, &size);
+    g_hmac_unref(hmac);
+}
+
+static gboolean derive_vault_keys(Vault* v, const gchar* passphrase, GError** error)
+{
+    static const gchar* labels[VAULT_KEY_COUNT] = { "encrypt", "authenticate", "index" };
+    guchar master[VAULT_KEY_SIZE];
+    guchar keys[VAULT_KEY_COUNT * VAULT_KEY_SIZE];
+    gcry_error_t failed = gcry_kdf_derive(passphrase, strlen(passphrase), GCRY_KDF_PBKDF2, GCRY_MD_SHA256, v->salt, VAULT_SALT_SIZE, v->iterations, sizeof(master), master);
+
+    if (failed) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not derive the keys: %s", gcry_strerror(failed));
+        return FALSE;
+    }
+
+    for (guint type = 0; type < VAULT_KEY_COUNT; type++)
+        vault_hmac(master, (const guchar*)labels[type], strlen(labels[type]), keys + type * VAULT_KEY_SIZE);
+
+    v->keys = secret_value_new((const gchar*)keys, sizeof(keys), "application/octet-stream");
+    memset(master, 0, sizeof(master));
+    memset(keys, 0, sizeof(keys));
+    return TRUE;
+}
+
+// AES-256-GCM context of one record, NULL if libgcrypt fails
+static gcry_cipher_hd_t open_vault_cipher(Vault* v, const guchar* nonce, guint64 hash)
+{
+    gcry_cipher_hd_t cipher = NULL;
+    guchar data[8];
+
+    put_uint64(data, hash);
+    if (gcry_cipher_open(&cipher, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM, 0))
+        return NULL;
+
+    if (gcry_cipher_setkey(cipher, get_vault_key(v, VAULT_ENCRYPT_KEY), VAULT_KEY_SIZE)
+        || gcry_cipher_setiv(cipher, nonce, VAULT_NONCE_SIZE)
+        || gcry_cipher_authenticate(cipher, data, sizeof(data))) {
+        gcry_cipher_close(cipher);
+        return NULL;
+    }
+
+    return cipher;
+}
+
+// Encrypt index key '\0' password and append it to records
+static gboolean seal_vault_record(Vault* v, guint64 hash, const gchar* key, SecretValue* value, GByteArray* records)
+{
+    gsize password_length = 0;
+    const gchar* password = secret_value_get(value, &password_length);
+    gsize length = strlen(key) + 1 + password_length;
+    guchar* record = g_malloc(VAULT_NONCE_SIZE + length + VAULT_TAG_SIZE);
+    guchar* data = record + VAULT_NONCE_SIZE;
+    gcry_cipher_hd_t cipher = NULL;
+    gboolean sealed = FALSE;
+
+    gcry_create_nonce(record, VAULT_NONCE_SIZE);
+    memcpy(data, key, strlen(key) + 1);
+    memcpy(data + strlen(key) + 1, password, password_length);
+
+    if ((cipher = open_vault_cipher(v, record, hash)) != NULL) {
+        sealed = !gcry_cipher_encrypt(cipher, data, length, NULL, 0) && !gcry_cipher_gettag(cipher, data + length, VAULT_TAG_SIZE);
+        gcry_cipher_close(cipher);
+    }
+
+    if (sealed)
+        g_byte_array_append(records, record, VAULT_NONCE_SIZE + length + VAULT_TAG_SIZE);
+
+    memset(record, 0, VAULT_NONCE_SIZE + length + VAULT_TAG_SIZE);
+    g_free(record);
+    return sealed;
+}
+
+static guint64 get_vault_hash(Vault* v, const gchar* key)
+{
+    guchar digest[VAULT_KEY_SIZE];
+
+    vault_hmac(get_vault_key(v, VAULT_INDEX_KEY), (const guchar*)key, strlen(key), digest);
+    return get_uint64(digest);
+}
+
+static void get_vault_entry(Vault* v, guint32 i, VaultEntry* entry)
+{
+    const guchar* data = v->index + (gsize)i * VAULT_ENTRY_SIZE;
+
+    entry->hash = get_uint64(data);
+    entry->offset = get_uint32(data + 8);
+    entry->length = get_uint32(data + 12);
+}
+
+static gboolean is_vault_entry_valid(Vault* v, const VaultEntry* entry)
+{
+    return (entry->offset <= v->records_length)
+        && (entry->length <= v->records_length - entry->offset)
+        && (entry->length > VAULT_NONCE_SIZE + VAULT_TAG_SIZE);
+}
+
+// Decrypted record of an index entry, NULL if it is damaged or has no key, to be wiped by the caller
+static gchar* open_vault_record(Vault* v, const VaultEntry* entry, gsize* length, gsize* key_length)
+{
+    const guchar* record = v->records + entry->offset;
+    gcry_cipher_hd_t cipher = NULL;
+    gchar* data = NULL;
+    gchar* end = NULL;
+    gboolean opened = FALSE;
+
+    if (!is_vault_entry_valid(v, entry))
+        return NULL;
+
+    *length = entry->length - VAULT_NONCE_SIZE - VAULT_TAG_SIZE;
+    data = g_malloc(*length);
+
+    if ((cipher = open_vault_cipher(v, record, entry->hash)) != NULL) {
+        opened = !gcry_cipher_decrypt(cipher, data, *length, record + VAULT_NONCE_SIZE, *length)
+            && !gcry_cipher_checktag(cipher, record + VAULT_NONCE_SIZE + *length, VAULT_TAG_SIZE);
+        gcry_cipher_close(cipher);
+    }
+
+    if (!opened || ((end = memchr(data, '\0', *length)) == NULL)) {
+        memset(data, 0, *length);
+        g_free(data);
+        return NULL;
+    }
+
+    *key_length = end - data;
+    return data;
+}
+
+// Index key of a record, NULL if it cannot be decrypted
+static gchar* get_vault_record_key(Vault* v, const VaultEntry* entry)
+{
+    gsize length = 0;
+    gsize key_length = 0;
+    gchar* record = open_vault_record(v, entry, &length, &key_length);
+    gchar* key = NULL;
+
+    if (record != NULL) {
+        key = g_strndup(record, key_length);
+        memset(record, 0, length);
+        g_free(record);
+    }
+
+    return key;
+}
+
+static void free_vault(Vault* v)
+{
+    if (v->mapped != NULL)
+        g_mapped_file_unref(v->mapped);
+    if (v->keys != NULL)
+        secret_value_unref(v->keys);
+    g_hash_table_destroy(v->changes);
+    g_free(v->path);
+    g_free(v);
+}
+
+static void free_vault_change(gpointer data)
+{
+    if (data != NULL)
+        secret_value_unref(data);
+}
+
+// Map and authenticate the vault at path, a missing file gives an empty new vault
+static Vault* open_vault(const gchar* path, const gchar* passphrase, GError** error)
+{
+    Vault* v = g_new0(Vault, 1);
+    GError* map_error = NULL;
+
+    v->path = g_strdup(path);
+    v->changes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_vault_change);
+    v->mapped = g_mapped_file_new(path, FALSE, &map_error);
+
+    if ((v->mapped == NULL) && g_error_matches(map_error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+        g_error_free(map_error);
+        v->iterations = KEYRING_VAULT_ITERATIONS;
+        if (!read_random_bytes(v->salt, sizeof(v->salt), error) || !derive_vault_keys(v, passphrase, error)) {
+            free_vault(v);
+            return NULL;
+        }
+        return v;
+    } else if (v->mapped == NULL) {
+        g_propagate_error(error, map_error);
+        free_vault(v);
+        return NULL;
+    }
+
+    const guchar* data = (const guchar*)g_mapped_file_get_contents(v->mapped);
+    gsize length = g_mapped_file_get_length(v->mapped);
+    guchar digest[VAULT_KEY_SIZE];
+
+    if ((length < VAULT_HEADER_SIZE + VAULT_KEY_SIZE) || (memcmp(data, VAULT_MAGIC, 8) != 0) || (get_uint32(data + 8) != VAULT_VERSION)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s is not a password file of this plugin", path);
+        free_vault(v);
+        return NULL;
+    }
+
+    guint32 count = get_uint32(data + 16 + VAULT_SALT_SIZE);
+    guint32 records_length = get_uint32(data + 20 + VAULT_SALT_SIZE);
+    gsize body = length - VAULT_HEADER_SIZE - VAULT_KEY_SIZE;
+
+    if ((count > body / VAULT_ENTRY_SIZE) || ((gsize)count * VAULT_ENTRY_SIZE + records_length != body)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s is damaged", path);
+        free_vault(v);
+        return NULL;
+    }
+
+    v->iterations = get_uint32(data + 12);
+    if ((v->iterations < VAULT_MIN_ITERATIONS) || (v->iterations > VAULT_MAX_ITERATIONS)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s is damaged", path);
+        free_vault(v);
+        return NULL;
+    }
+    memcpy(v->salt, data + 16, VAULT_SALT_SIZE);
+    if (!derive_vault_keys(v, passphrase, error)) {
+        free_vault(v);
+        return NULL;
+    }
+
+    vault_hmac(get_vault_key(v, VAULT_AUTH_KEY), (const guchar*)VAULT_CHECK, strlen(VAULT_CHECK), digest);
+    if (!equal_digests(digest, data + VAULT_HEADER_SIZE - VAULT_KEY_SIZE)) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED, "Wrong passphrase");
+        free_vault(v);
+        return NULL;
+    }
+
+    // Covers the index too, the records are only decrypted by their lookups
+    vault_hmac(get_vault_key(v, VAULT_AUTH_KEY), data, length - VAULT_KEY_SIZE, digest);
+    if (!equal_digests(digest, data + length - VAULT_KEY_SIZE)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s is damaged", path);
+        free_vault(v);
+        return NULL;
+    }
+
+    v->index = data + VAULT_HEADER_SIZE;
+    v->count = count;
+    v->records = v->index + (gsize)count * VAULT_ENTRY_SIZE;
+    v->records_length = records_length;
+
+    return v;
+}
+
+// Password of an index key in the mapped vault, only the records with its hash are decrypted
+static SecretValue* find_vault_record(Vault* v, const gchar* key)
+{
+    guint64 hash = get_vault_hash(v, key);
+    gsize length = strlen(key);
+    guint32 low = 0;
+    guint32 high = v->count;
+    VaultEntry entry;
+
+    // First entry with the hash, the keys of (unlikely) equal hashes follow it
+    while (low < high) {
+        guint32 mid = low + (high - low) / 2;
+
+        get_vault_entry(v, mid, &entry);
+        if (entry.hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (; low < v->count; low++) {
+        gsize record_length = 0;
+        gsize key_length = 0;
+        gchar* record = NULL;
+        SecretValue* value = NULL;
+
+        get_vault_entry(v, low, &entry);
+        if (entry.hash != hash)
+            break;
+
+        if ((record = open_vault_record(v, &entry, &record_length, &key_length)) == NULL)
+            continue;
+
+        if ((key_length == length) && (memcmp(record, key, length) == 0))
+            value = secret_value_new(record + length + 1, record_length - length - 1, "text/plain");
+
+        memset(record, 0, record_length);
+        g_free(record);
+        if (value != NULL)
+            return value;
+    }
+
+    return NULL;
+}
+
+// Current password of an index key, including the changes not written yet
+static SecretValue* lookup_vault_secret(const gchar* key)
+{
+    gpointer value = NULL;
+
+    if (g_hash_table_lookup_extended(vault->changes, key, NULL, &value))
+        return (value != NULL) ? secret_value_ref(value) : NULL;
+
+    return find_vault_record(vault, key);
+}
+
+static gint compare_vault_entries(gconstpointer a, gconstpointer b)
+{
+    const VaultEntry* x = a;
+    const VaultEntry* y = b;
+
+    return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+// Write the records and the changes to a new vault file and map it
+static gboolean write_vault(Vault* v, GError** error)
+{
+    GByteArray* records = g_byte_array_new();
+    GArray* entries = g_array_new(FALSE, FALSE, sizeof(VaultEntry));
+    GHashTable* changed = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    GHashTableIter iter;
+    gpointer key, value;
+    gint64 started = g_get_monotonic_time();
+    gboolean written = FALSE;
+
+    // Changed records get a new nonce, the keys stay the same
+    g_hash_table_iter_init(&iter, v->changes);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        VaultEntry entry = { get_vault_hash(v, key), records->len, 0 };
+        guint64* hash = g_new(guint64, 1);
+
+        *hash = entry.hash;
+        g_hash_table_add(changed, hash);
+
+        if (value == NULL)
+            continue;
+
+        if (!seal_vault_record(v, entry.hash, key, value, records)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not encrypt the passwords of %s", v->path);
+            record_operation_error(OP_CREATE);
+            g_hash_table_destroy(changed);
+            g_byte_array_free(records, TRUE);
+            g_array_free(entries, TRUE);
+            return FALSE;
+        }
+
+        entry.length = records->len - entry.offset;
+        g_array_append_val(entries, entry);
+    }
+
+    // Unchanged records are copied as they are, only a shared hash needs a decrypt to tell them apart
+    for (guint32 i = 0; i < v->count; i++) {
+        VaultEntry entry;
+
+        get_vault_entry(v, i, &entry);
+        if (!is_vault_entry_valid(v, &entry))
+            continue;
+
+        if (g_hash_table_contains(changed, &entry.hash)) {
+            gchar* record_key = get_vault_record_key(v, &entry);
+            gboolean replaced = (record_key == NULL) || g_hash_table_contains(v->changes, record_key);
+
+            g_free(record_key);
+            if (replaced)
+                continue;
+        }
+
+        g_byte_array_append(records, v->records + entry.offset, entry.length);
+        entry.offset = records->len - entry.length;
+        g_array_append_val(entries, entry);
+    }
+
+    g_array_sort(entries, compare_vault_entries);
+
+    gsize length = VAULT_HEADER_SIZE + (gsize)entries->len * VAULT_ENTRY_SIZE + records->len + VAULT_KEY_SIZE;
+    guchar* data = g_malloc0(length);
+    guchar* body = data + VAULT_HEADER_SIZE;
+
+    memcpy(data, VAULT_MAGIC, 8);
+    put_uint32(data + 8, VAULT_VERSION);
+    put_uint32(data + 12, v->iterations);
+    memcpy(data + 16, v->salt, VAULT_SALT_SIZE);
+    put_uint32(data + 16 + VAULT_SALT_SIZE, entries->len);
+    put_uint32(data + 20 + VAULT_SALT_SIZE, records->len);
+    vault_hmac(get_vault_key(v, VAULT_AUTH_KEY), (const guchar*)VAULT_CHECK, strlen(VAULT_CHECK), body - VAULT_KEY_SIZE);
+
+    for (guint i = 0; i < entries->len; i++) {
+        VaultEntry* entry = &g_array_index(entries, VaultEntry, i);
+
+        put_uint64(body, entry->hash);
+        put_uint32(body + 8, entry->offset);
+        put_uint32(body + 12, entry->length);
+        body += VAULT_ENTRY_SIZE;
+    }
+
+    memcpy(body, records->data, records->len);
+    vault_hmac(get_vault_key(v, VAULT_AUTH_KEY), data, length - VAULT_KEY_SIZE, data + length - VAULT_KEY_SIZE);
+
+    // Written to a temporary file and renamed, only readable by the user
+    if (!purple_util_write_data_to_file_absolute(v->path, (const gchar*)data, length)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not write %s", v->path);
+    } else {
+        GMappedFile* mapped = g_mapped_file_new(v->path, FALSE, error);
+
+        if (mapped != NULL) {
+            if (v->mapped != NULL)
+                g_mapped_file_unref(v->mapped);
+
+            v->mapped = mapped;
+            v->index = (const guchar*)g_mapped_file_get_contents(mapped) + VAULT_HEADER_SIZE;
+            v->count = entries->len;
+            v->records = v->index + (gsize)entries->len * VAULT_ENTRY_SIZE;
+            v->records_length = records->len;
+            g_hash_table_remove_all(v->changes);
+            written = TRUE;
+        }
+    }
+
+    record_operation(OP_CREATE, g_get_monotonic_time() - started);
+    if (!written)
+        record_operation_error(OP_CREATE);
+
+    g_hash_table_destroy(changed);
+    g_byte_array_free(records, TRUE);
+    g_array_free(entries, TRUE);
+    g_free(data);
+
+    return written;
+}
+
+// Write-behind timer, failed changes are kept for the next write
+static gboolean flush_vault(gpointer data)
+{
+    GError* error = NULL;
+
+    vault->write_timer = 0;
+    if (!write_vault(vault, &error)) {
+        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not save the password file.", error->message);
+        g_error_free(error);
+    }
+
+    return FALSE;
+}
+
+// Change the password of an index key, NULL deletes it
+static void set_vault_secret(const gchar* key, SecretValue* value)
+{
+    g_hash_table_replace(vault->changes, g_strdup(key), (value != NULL) ? secret_value_ref(value) : NULL);
+
+    if (vault->write_timer == 0)
+        vault->write_timer = purple_timeout_add(KEYRING_WRITE_DELAY, flush_vault, NULL);
+}
+
+static gchar* get_vault_path()
+{
+    return g_build_filename(purple_user_dir(), KEYRING_VAULT_FILE, NULL);
+}
+
+// Key derivation of an unlock, runs in a thread so the messenger does not freeze
+typedef struct {
+    gchar* path;
+    SecretValue* passphrase;
+    gint64 started;
+    Vault* vault; // result of the thread, NULL if error is set
+    GError* error;
+} VaultUnlock;
+
+GThread* vault_unlock_thread = NULL; // joined by its result or by the unload
+VaultUnlock* vault_unlock = NULL;
+
+static void free_vault_unlock(VaultUnlock* unlock)
+{
+    g_free(unlock->path);
+    secret_value_unref(unlock->passphrase);
+    g_free(unlock);
+}
+
+static gboolean on_vault_opened(gpointer data);
+
+static gpointer open_vault_thread(gpointer data)
+{
+    VaultUnlock* unlock = (VaultUnlock*)data;
+
+    unlock->vault = open_vault(unlock->path, secret_value_get_text(unlock->passphrase), &unlock->error);
+    g_idle_add(on_vault_opened, unlock);
+    return NULL;
+}
+
+// Back on the main loop, error is NULL if v is the unlocked vault
+static void finish_vault_unlock(Vault* v, GError* error, gint64 started)
+{
+    gboolean init = unlock_init;
+
+    if ((vault = v) != NULL) {
+        record_operation(OP_UNLOCK, g_get_monotonic_time() - started);
+
+        // Written right away, so the passphrase of a new vault is checked from the next start on
+        if ((vault->mapped == NULL) && !write_vault(vault, &error)) {
+            dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not save the password file.", error->message);
+            g_clear_error(&error);
+        }
+
+        purple_debug_info(PLUGIN_ID, "Unlocked password file with %u passwords\n", vault->count);
+        unlock_init = FALSE;
+        if (init)
+            init_accounts();
+        set_collection_state(COLLECTION_READY);
+    } else if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        record_operation_error(OP_UNLOCK);
+        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not unlock the password file.", error->message);
+    }
+
+    if (error != NULL) {
+        // Next call asks again, the accounts are initialized by the first successful unlock
+        set_collection_state(COLLECTION_LOCKED);
+        resume_waiting_calls(error);
+        g_error_free(error);
+        if (init)
+            release_held_accounts();
+    }
+}
+
+// The thread has returned its result, joining it does not block
+static gboolean on_vault_opened(gpointer data)
+{
+    VaultUnlock* unlock = (VaultUnlock*)data;
+
+    g_thread_join(vault_unlock_thread);
+    vault_unlock_thread = NULL;
+    vault_unlock = NULL;
+
+    finish_vault_unlock(unlock->vault, unlock->error, unlock->started);
+    free_vault_unlock(unlock);
+    return FALSE;
+}
+
+static void on_vault_passphrase(gpointer data, const gchar* passphrase)
+{
+    if ((passphrase == NULL) || (*passphrase == '\0')) {
+        finish_vault_unlock(NULL, g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Password file was not unlocked"), 0);
+        return;
+    }
+
+    vault_unlock = g_new0(VaultUnlock, 1);
+    vault_unlock->path = get_vault_path();
+    vault_unlock->passphrase = secret_value_new(passphrase, -1, "text/plain");
+    vault_unlock->started = g_get_monotonic_time();
+
+    vault_unlock_thread = g_thread_new("purple-gnome-keyring-vault", open_vault_thread, vault_unlock);
+}
+
+// Unload: the key derivation cannot be interrupted, wait for it and drop its result
+static void abandon_vault_unlock()
+{
+    if (vault_unlock_thread == NULL)
+        return;
+
+    purple_debug_info(PLUGIN_ID, "Waiting for the password file to be unlocked\n");
+    g_thread_join(vault_unlock_thread);
+    g_idle_remove_by_data(vault_unlock);
+
+    if (vault_unlock->vault != NULL)
+        free_vault(vault_unlock->vault);
+    g_clear_error(&vault_unlock->error);
+    free_vault_unlock(vault_unlock);
+
+    vault_unlock_thread = NULL;
+    vault_unlock = NULL;
+}
+
+static void on_vault_passphrase_cancelled(gpointer data, const gchar* passphrase)
+{
+    on_vault_passphrase(data, NULL);
+}
+
+// A typo in the passphrase of a new vault would lock away every password, so it is entered twice
+static void on_new_vault_passphrase(gpointer data, PurpleRequestFields* fields)
+{
+    const gchar* passphrase = purple_request_fields_get_string(fields, "passphrase");
+
+    if (g_strcmp0(passphrase, purple_request_fields_get_string(fields, "confirm")) != 0) {
+        dialog(PURPLE_NOTIFY_MSG_ERROR, "The passphrases do not match.", "Please enter the same passphrase twice.");
+        request_vault_passphrase();
+        return;
+    }
+
+    on_vault_passphrase(data, passphrase);
+}
+
+static void on_new_vault_cancelled(gpointer data, PurpleRequestFields* fields)
+{
+    on_vault_passphrase(data, NULL);
+}
+
+static void request_new_vault_passphrase()
+{
+    PurpleRequestFields* fields = purple_request_fields_new();
+    PurpleRequestFieldGroup* group = purple_request_field_group_new(NULL);
+    PurpleRequestField* field = NULL;
+
+    field = purple_request_field_string_new("passphrase", "Passphrase", NULL, FALSE);
+    purple_request_field_string_set_masked(field, TRUE);
+    purple_request_field_set_required(field, TRUE);
+    purple_request_field_group_add_field(group, field);
+
+    field = purple_request_field_string_new("confirm", "Confirm passphrase", NULL, FALSE);
+    purple_request_field_string_set_masked(field, TRUE);
+    purple_request_field_set_required(field, TRUE);
+    purple_request_field_group_add_field(group, field);
+
+    purple_request_fields_add_group(fields, group);
+
+    purple_request_fields(gnome_keyring_plugin,
+        "Gnome Keyring",
+        "Create a password file",
+        "Please choose a passphrase for the encrypted password file. It is asked for at every start.",
+        fields,
+        "Create",
+        G_CALLBACK(on_new_vault_passphrase),
+        "Cancel",
+        G_CALLBACK(on_new_vault_cancelled),
+        NULL,
+        NULL,
+        NULL,
+        NULL);
+}
+
+// Counterpart of the keyring unlock, the passphrase is asked for every start
+static void request_vault_passphrase()
+{
+    gchar* path = get_vault_path();
+    gboolean exists = g_file_test(path, G_FILE_TEST_EXISTS);
+
+    purple_debug_info(PLUGIN_ID, "Unlocking password file %s\n", path);
+    set_collection_state(COLLECTION_UNLOCKING);
+
+    if (!exists) {
+        request_new_vault_passphrase();
+        g_free(path);
+        return;
+    }
+
+    purple_request_input(gnome_keyring_plugin,
+        "Gnome Keyring",
+        "Unlock the password file",
+        "Please enter the passphrase of the encrypted password file.",
+        NULL,
+        FALSE,
+        TRUE,
+        NULL,
+        "Unlock",
+        G_CALLBACK(on_vault_passphrase),
+        "Cancel",
+        G_CALLBACK(on_vault_passphrase_cancelled),
+        NULL,
+        NULL,
+        NULL,
+        NULL);
+
+    g_free(path);
+}
+
+// Start of the vault backend, instead of connecting to the Secret Service
+static void init_vault()
+{
+    init_gcrypt();
+    unlock_init = TRUE;
+    set_collection_state(COLLECTION_LOCKED);
+    request_unlock();
+}
+
+// Write the last changes and wipe the keys
+static void close_vault()
+{
+    abandon_vault_unlock();
+    if (vault == NULL)
+        return;
+
+    if (vault->write_timer != 0) {
+        purple_timeout_remove(vault->write_timer);
+        flush_vault(NULL);
+    }
+
+    free_vault(vault);
+    vault = NULL;
+}
+
+// Vault counterpart of the batch load, each lookup decrypts only the record of its account
+static void load_vault_batch(GList* accounts, void (*release)(PurpleAccount* account, SecretValue* value))
+{
+    gint64 started = g_get_monotonic_time();
+
+    for (GList* li = accounts; li != NULL; li = li->next) {
+        SecretValue* value = lookup_vault_secret(get_account_context(li->data)->key);
+
+        release(li->data, value);
+        if (value != NULL)
+            secret_value_unref(value);
+    }
+
+    g_list_free(accounts);
+    record_operation(OP_GET_SECRETS, g_get_monotonic_time() - started);
+}
+
+// Vault counterpart of the sweep: drop the passwords of deleted accounts, or those of all known accounts
+static void sweep_vault(gboolean all, gboolean report)
+{
+    GHashTable* keys = g_hash_table_new(g_str_hash, g_str_equal);
+    GPtrArray* orphans = g_ptr_array_new_with_free_func(g_free);
+    GHashTableIter iter;
+    gpointer key, value;
+    guint total = 0;
+
+    for (GList* li = purple_accounts_get_all(); li != NULL; li = li->next)
+        g_hash_table_add(keys, get_account_context(li->data)->key);
+
+    // The one pass that decrypts every record, only the keys are kept
+    for (guint32 i = 0; i < vault->count; i++) {
+        VaultEntry entry;
+        gchar* record_key = NULL;
+
+        get_vault_entry(vault, i, &entry);
+        if ((record_key = get_vault_record_key(vault, &entry)) == NULL)
+            continue;
+
+        if (!g_hash_table_contains(vault->changes, record_key))
+            g_ptr_array_add(orphans, record_key);
+        else
+            g_free(record_key);
+    }
+
+    g_hash_table_iter_init(&iter, vault->changes);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (value != NULL)
+            g_ptr_array_add(orphans, g_strdup(key));
+    }
+
+    total = orphans->len;
+    for (guint i = 0; i < orphans->len; i++) {
+        if (g_hash_table_contains(keys, orphans->pdata[i]) != all)
+            total--;
+        else
+            set_vault_secret(orphans->pdata[i], NULL);
+    }
+
+    purple_debug_info(PLUGIN_ID, "Password file sweep: %u passwords deleted\n", total);
+    if (report) {
+        gchar* msg = g_strdup_printf("Deleted %u passwords", total);
+        dialog(PURPLE_NOTIFY_MSG_INFO, msg, NULL);
+        g_free(msg);
+    }
+
+    g_ptr_array_free(orphans, TRUE);
+    g_hash_table_destroy(keys);
+}
+
+static void write_vault_password(PipelineCall* call)
+{
+    PurpleAccount* account = call->account;
+    const gchar* password = get_store_password(call);
+
+    // Account may have been removed while the store was queued
+    if ((g_list_find(purple_accounts_get_all(), account) == NULL) || (password == NULL)) {
+        pipeline_call_skip(call);
+        return;
+    }
+
+    purple_account_set_remember_password(account, FALSE);
+    if (is_secret_written(call->context, password)) {
+        pipeline_call_skip(call);
+        return;
+    }
+
+    SecretValue* value = secret_value_new(password, -1, "text/plain");
+
+    purple_debug_info(PLUGIN_ID, "Storing %s password with username %s in the password file\n", account->protocol_id, account->username);
+    set_vault_secret(call->context->key, value);
+    remember_written_secret(call->context, password);
+    secret_value_unref(value);
+    pipeline_call_finish(call, NULL, NULL);
+}
+
+static void read_vault_password(PipelineCall* call)
+{
+    PurpleAccount* account = call->account;
+    SecretValue* value = NULL;
+
+    if (purple_account_get_remember_password(account)) {
+        pipeline_call_finish(call, NULL, NULL);
+        return;
+    }
+
+    if ((value = lookup_vault_secret(call->context->key)) != NULL) {
+        purple_debug_info(PLUGIN_ID, "Setting password for %s with username %s\n", account->protocol_id, account->username);
+        purple_account_set_password(account, secret_value_get_text(value));
+        remember_written_secret(call->context, secret_value_get_text(value));
+        secret_value_unref(value);
+    } else {
+        purple_debug_info(PLUGIN_ID, "%s: Password is empty - no password saved\n", account->protocol_id);
+    }
+
+    // Fallback of the init pipeline
+    release_init_account(account, NULL);
+    pipeline_call_finish(call, NULL, NULL);
+}
+
+static void remove_vault_password(PipelineCall* call)
+{
+    SecretValue* value = lookup_vault_secret(call->context->key);
+
+    // Deleted because the account was removed
+    if (g_list_find(purple_accounts_get_all(), call->account) != NULL)
+        purple_account_set_remember_password(call->account, FALSE);
+    invalidate_cached_secret(call->context);
+    cancel_pending_store(call->account);
+    forget_written_secret(call->context);
+
+    if (value != NULL) {
+        set_vault_secret(call->context->key, NULL);
+        secret_value_unref(value);
+    }
+
+    pipeline_call_finish(call, NULL, NULL);
+}
+
+/**************************************************
+ **************************************************
+ ************ Store password pipline **************
+ **************************************************
+ **************************************************/
+
+// Error check
+static void on_item_created(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    PipelineCall* call = (PipelineCall*)user_data;
+    PurpleAccount* account = call->account;
+    GError* error = NULL;
+    SecretItem* item = secret_item_create_finish(result, &error);
+    track_object(LIVE_ITEM, item);
+
+    purple_debug_info(PLUGIN_ID, "Finished storing password\n");
+
+    if (error != NULL) {
+        // Keyring content is unknown now, do not skip the next store
+        record_operation_error(OP_CREATE);
+        forget_written_secret(call->context);
+    } else {
+        if (account->password != NULL) {
+
+            // This will lead to crashes for some protocols, e.g. opensteamworks. Maybe time it or just use the signed on freeing...
+            /* purple_account_set_password(account, "Lorem ipsum dolor sit amet, consectetur adipiscing elit. Cras eu semper eros. Donec non gravida mi. Vestibulum ante ipsum primis in faucibus orci luctus et ultrices posuere cubilia Curae; Phasellus malesuada nisl eget est elementum, in ullamcorper nullam."); */
+
+            /* g_free(account->password); */
+            /* account->password = NULL; */
+
+            purple_debug_info(PLUGIN_ID, "Cleared password for %s with username %s\n", account->protocol_id, account->username);
+        }
+
+        purple_debug_info(PLUGIN_ID, "%s password successfully saved for %s\n", account->protocol_id, account->username);
+        purple_account_set_remember_password(account, FALSE);
+        remember_account_item_path(call->context, item);
+        g_object_unref(item);
+    }
+
+    pipeline_call_finish(call, "Error saving passwort to keyring", error);
+
+    /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+}
+
+// Write the current password of an account to the keyring
+static void write_account_password(PipelineCall* call)
+{
+    /* unlock_collection(plugin_collection, NULL); */
+    PurpleAccount* account = call->account;
+    const gchar* password = get_store_password(call);
+
+    // Account may have been removed while the store was queued
+    if (g_list_find(purple_accounts_get_all(), account) == NULL) {
+        pipeline_call_skip(call);
+        return;
+    }
+
+    if (password == NULL) {
+        purple_debug_info(PLUGIN_ID, "No %s password to store for %s\n", account->protocol_id, account->username);
+        pipeline_call_skip(call);
+        return;
+    }
+
+    if (is_secret_written(call->context, password)) {
+        purple_debug_info(PLUGIN_ID, "%s password for %s is unchanged, skipping write\n", account->protocol_id, account->username);
+        purple_account_set_remember_password(account, FALSE);
+        pipeline_call_skip(call);
+        return;
+    }
+
+    SecretValue* value = secret_value_new(password, -1, "text/plain");
+
+    purple_debug_info(PLUGIN_ID, "Storing %s password with username %s\n", account->protocol_id, account->username);
+    remember_written_secret(call->context, password);
+
+    TimedCall* timed = timed_call_new(OP_CREATE, call->cancellable, on_item_created, call, abandon_pipeline_call);
+    keyring_item_create(timed, plugin_collection, call->context->attributes, call->context->label, value, SECRET_ITEM_CREATE_REPLACE);
+
+    secret_value_unref(value);
+}
+
+// Submit a store call, it runs after the calls already pending for the account
+static void start_store_call(PipelineCall* call)
+{
+    pipeline_submit(call, PIPELINE_STORE, (plugin_backend == BACKEND_VAULT) ? write_vault_password : write_account_password);
+}
+
+static void free_pending_store(gpointer data)
+{
+    if (data != NULL)
+        secret_value_unref(data);
+}
+
+// Flush the write-behind queue, each store writes the password the account had when it was queued
+static gboolean flush_pending_stores(gpointer data)
+{
+    GHashTableIter iter;
+    gpointer account, value;
+    GList* calls = NULL;
+
+    store_flush_timer = 0;
+
+    // Taken off the queue first, the calls may queue or cancel stores when they finish
+    g_hash_table_iter_init(&iter, pending_stores);
+    while (g_hash_table_iter_next(&iter, &account, &value)) {
+        PipelineCall* call = pipeline_call_new(account, NULL, NULL, NULL);
+
+        call->value = value;
+        g_hash_table_iter_steal(&iter);
+        calls = g_list_prepend(calls, call);
+    }
+
+    for (GList* li = calls; li != NULL; li = li->next)
+        start_store_call(li->data);
+    g_list_free(calls);
+
+    return FALSE;
+}
+
+// Drop a queued store, e.g. because the password gets deleted
+static void cancel_pending_store(PurpleAccount* account)
+{
+    g_hash_table_remove(pending_stores, account);
+}
+
+// Store password in the keyring, repeated stores of an account are merged
+static void store_account_password(gpointer data, gpointer user_data)
+{
+    PurpleAccount* account = (PurpleAccount*)data;
+
+    const gchar* password = purple_account_get_password(account);
+
+    purple_debug_info(PLUGIN_ID, "Queueing %s password store with username %s\n", account->protocol_id, account->username);
+    invalidate_cached_secret(get_account_context(account));
+
+    // A sign on may clear the password of the account before the flush
+    g_hash_table_replace(pending_stores, account, (password != NULL) ? secret_value_new(password, -1, "text/plain") : NULL);
+
+    if (store_flush_timer == 0)
+        store_flush_timer = purple_timeout_add(KEYRING_WRITE_DELAY, flush_pending_stores, NULL);
+}
+
+/**************************************************
+ **************************************************
+ ************* Load password pipline **************
+ **************************************************
+ **************************************************/
+
+static void on_item_loaded(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    PipelineCall* call = (PipelineCall*)user_data;
+    PurpleAccount* account = call->account;
+
+    GError* error = NULL;
+    GList* items = secret_collection_search_finish(plugin_collection, result, &error);
+    track_items(items);
+
     if (error != NULL) {
-        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not connect to the Gnome Keyring.", error->message);
-        g_error_free(error);
-    } else if (service == NULL) {
-        purple_debug_info(PLUGIN_ID, "No service detected\n");
+        // Reported by pipeline_call_finish
+        record_operation_error(OP_SEARCH);
+    } else if (items == NULL) {
+        purple_debug_info(PLUGIN_ID, "%s: Password is empty - no password saved\n", account->protocol_id);
     } else {
-        purple_debug_info(PLUGIN_ID, "Successfully initialized secret service\n");
-        init_collection(service);
-        g_object_unref(service);
+        SecretItem* item = items->data;
+        SecretValue* value = secret_item_get_secret(item);
+
+        purple_debug_info(PLUGIN_ID, "Setting password for %s with username %s\n", account->protocol_id, account->username);
+        purple_account_set_password(account, secret_value_get_text(value));
+        remember_account_item_path(call->context, item);
+        cache_account_secret(call->context, value);
+        remember_written_secret(call->context, secret_value_get_text(value));
+
+        secret_value_unref(value);
+        g_list_free_full(items, g_object_unref);
     }
+
+    // Fallback of the init pipeline
+    release_init_account(account, NULL);
+
+    pipeline_call_finish(call, "Could not read password", error);
 }
 
-// Opened service callback
-/* static void on_service_opened(GObject* source, */
-/*         GAsyncResult* result, */
-/*         gpointer user_data) */
-/* { */
+// Start the load pipeline for an account
+static void fetch_account_password(PipelineCall* call)
+{
+    PurpleAccount* account = call->account;
 
-/*     GError* error           = NULL; */
-/*     SecretService* service  = secret_service_open_finish(result, &error); */
+    if (purple_account_get_remember_password(account)) {
+        pipeline_call_finish(call, NULL, NULL);
+        return;
+    }
 
-/*     if(error != NULL) */
-/*     { */
-/*         dialog( PURPLE_NOTIFY_MSG_ERROR, "Could not connect to the Gnome Keyring.", error->message); */
-/*         g_error_free(error); */
-/*     } */
-/*     else if (service == NULL) */
-/*     { */
-/*         purple_debug_info(PLUGIN_ID, "No service detected\n" ); */
-/*     } */
-/*     else */
-/*     { */
-/*         purple_debug_info(PLUGIN_ID, "Successfully initialized secret service\n" ); */
-/*         init_collection(service); */
-/*         g_object_unref(service); */
-/*     } */
+    SecretValue* cached = lookup_cached_secret(call->context);
+    if (cached != NULL) {
+        purple_debug_info(PLUGIN_ID, "Setting cached password for %s with username %s\n", account->protocol_id, account->username);
+        purple_account_set_password(account, secret_value_get_text(cached));
+        release_init_account(account, NULL);
+        pipeline_call_finish(call, NULL, NULL);
+        return;
+    }
 
-/* } */
+    /* unlock_collection(plugin_collection); */
+    purple_debug_info(PLUGIN_ID, "Loading password %s with username %s\n", account->protocol_id, account->username);
 
-// Init collection
-static void init_secret_service()
+    TimedCall* timed = timed_call_new(OP_SEARCH, call->cancellable, on_item_loaded, call, abandon_pipeline_call);
+    keyring_search(timed, plugin_collection, call->context->attributes, SECRET_SEARCH_UNLOCK | SECRET_SEARCH_LOAD_SECRETS);
+
+    /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+}
+
+// Submit a load call, merged with a load already pending for the account
+static void start_load_call(PipelineCall* call)
 {
-    purple_debug_info(PLUGIN_ID, "Initializing secret service\n");
-    secret_service_get(SECRET_SERVICE_OPEN_SESSION | SECRET_SERVICE_LOAD_COLLECTIONS, NULL, on_got_service, NULL);
-    /* secret_service_open(SECRET_TYPE_SERVICE, */
-    /*         NULL, */
-    /*         SECRET_SERVICE_OPEN_SESSION | SECRET_SERVICE_LOAD_COLLECTIONS, */
-    /*         NULL, /1* GCancellable, *1/ */
-    /*         on_service_opened, */
-    /*         NULL); */
+    pipeline_submit(call, PIPELINE_LOAD, (plugin_backend == BACKEND_VAULT) ? read_vault_password : fetch_account_password);
+}
+
+// Load password of account from secret collection
+static void load_account_password(gpointer data, gpointer user_data)
+{
+    start_load_call(pipeline_call_new((PurpleAccount*)data, NULL, NULL, NULL));
+}
+
+/**************************************************
+ **************************************************
+ *************** Reconnect prefetch ***************
+ **************************************************
+ **************************************************/
+
+// Disconnected account that libpurple will reconnect, but without a password to do so
+static gboolean needs_prefetch(PurpleAccount* account)
+{
+    return purple_account_get_enabled(account, purple_core_get_ui())
+        && !purple_account_get_remember_password(account)
+        && (purple_account_get_password(account) == NULL)
+        && purple_account_is_disconnected(account)
+        && purple_status_is_online(purple_account_get_active_status(account));
+}
+
+// Release function of prefetch batches, the reconnect of libpurple picks the password up
+static void release_prefetched_account(PurpleAccount* account, SecretValue* value)
+{
+    // Account may have been removed while loading
+    if ((value == NULL) || (g_list_find(purple_accounts_get_all(), account) == NULL))
+        return;
+
+    purple_debug_info(PLUGIN_ID, "Prefetched password for %s with username %s\n", account->protocol_id, account->username);
+    purple_account_set_password(account, secret_value_get_text(value));
+    cache_account_secret(get_account_context(account), value);
+    remember_written_secret(get_account_context(account), secret_value_get_text(value));
+}
+
+/*
+ * The reconnect delay after a network error depends on the UI, Pidgin picks it at random. The password is
+ * fetched right away and stays set until the reconnect signs on, account_signed_on clears it then.
+ */
+static void prefetch_account(PurpleAccount* account)
+{
+    if (purple_account_get_remember_password(account) || (purple_account_get_password(account) != NULL))
+        return;
+
+    purple_debug_info(PLUGIN_ID, "Prefetching password for %s with username %s\n", account->protocol_id, account->username);
+    load_account_password(account, NULL);
+}
+
+// The messenger reconnects all accounts at once when the network is back, fetch their passwords in one batch
+static void prefetch_reconnecting_accounts()
+{
+    GList* accounts = NULL;
+    GList* pending = NULL;
+
+    accounts = purple_accounts_get_all_active();
+
+    for (GList* li = accounts; li != NULL; li = li->next) {
+        PurpleAccount* account = li->data;
+        AccountContext* context = NULL;
+        SecretValue* cached = NULL;
+
+        if (!needs_prefetch(account))
+            continue;
+
+        context = get_account_context(account);
+        cached = lookup_cached_secret(context);
+        if (cached != NULL)
+            purple_account_set_password(account, secret_value_get_text(cached));
+        else if (plugin_state == COLLECTION_READY)
+            pending = g_list_prepend(pending, account);
+        else
+            load_account_password(account, NULL); // queued until the collection is ready
+    }
+    g_list_free(accounts);
+
+    if (pending != NULL) {
+        purple_debug_info(PLUGIN_ID, "Network is back, prefetching %u passwords\n", g_list_length(pending));
+        load_secret_batch(g_list_reverse(pending), release_prefetched_account);
+    }
+}
+
+/**************************************************
+ **************************************************
+ *************** On-demand passwords **************
+ **************************************************
+ **************************************************/
+
+/*
+ * purple_account_connect() asks for the password of an account that has none. In on-demand mode, and for
+ * accounts whose init password is still loading, the prompt is closed and the password loaded instead.
+ * release_init_account connects the account once it is there, or lets the messenger ask again.
+ */
+static void load_wanted_password(PurpleAccount* account)
+{
+    // Plugin is unloading, or the account was removed meanwhile
+    if ((init_pending == NULL) || (g_list_find(purple_accounts_get_all(), account) == NULL) || !is_waiting_for_password(account))
+        return;
+
+    if (g_hash_table_contains(init_pending, account)) {
+        hold_account(account);
+        return;
+    }
+
+    if (!purple_prefs_get_bool(KEYRING_ON_DEMAND_PREF))
+        return;
+
+    purple_debug_info(PLUGIN_ID, "Loading password on demand for %s with username %s\n", account->protocol_id, account->username);
+    hold_account(account);
+    g_hash_table_add(init_pending, account);
+    load_account_password(account, NULL);
+}
+
+static gboolean on_password_wanted(gpointer data)
+{
+    PurpleAccount* account = (PurpleAccount*)data;
+
+    get_account_context(account)->prompt_timer = 0;
+    load_wanted_password(account);
+
+    return FALSE;
+}
+
+// The sign on may run before or after the signal that announces it, so the account is checked again right after
+static void check_password_wanted(PurpleAccount* account)
+{
+    AccountContext* context = get_account_context(account);
+
+    load_wanted_password(account);
+    if (context->prompt_timer == 0)
+        context->prompt_timer = purple_timeout_add(0, on_password_wanted, account);
+}
+
+/**************************************************
+ **************************************************
+ ************ Delete password pipline *************
+ **************************************************
+ **************************************************/
+
+// Deleted callback
+static void on_password_deleted(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+
+    PipelineCall* call = (PipelineCall*)user_data;
+    GError* error = NULL;
+    gboolean success = secret_item_delete_finish(SECRET_ITEM(source), result, &error);
+
+    if (error != NULL) {
+        record_operation_error(OP_DELETE);
+    } else {
+        // Kept until here, the sweep removes the item if the delete fails
+        forget_item_path(call->context->key, SECRET_ITEM(source));
+        if (success)
+            purple_debug_info(PLUGIN_ID, "Successfully deteted password for %s\n", call->context->protocol_id);
+        else
+            purple_debug_info(PLUGIN_ID, "Could not detete password for %s, but no error occured\n", call->context->protocol_id);
+    }
+
+    pipeline_call_finish(call, "Could not delete password.", error);
+
+    /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+}
+
+// Delete from collection
+static void delete_collection_password(GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+
+    PipelineCall* call = (PipelineCall*)user_data;
+    GError* error = NULL;
+    GList* items = secret_collection_search_finish(plugin_collection, result, &error);
+    track_items(items);
+
+    if (error != NULL) {
+        record_operation_error(OP_SEARCH);
+        pipeline_call_finish(call, "Could not delete password", error);
+    } else if (items == NULL) {
+        purple_debug_info(PLUGIN_ID, "%s: No password found for deletion\n", call->context->protocol_id);
+        /* print_protocol_info_message(purple_account_get_protocol_name(account), "Password is empty or no password given"); */
+        pipeline_call_finish(call, NULL, NULL);
+    } else {
+        SecretItem* item = items->data;
+
+        // Not valid operation if account is deleted -> separate it
+        /* SecretValue* value  = secret_item_get_secret(item); */
+        /* purple_account_set_password(account, secret_value_get_text(value)); */
+        /* secret_value_unref(value); */
+
+        TimedCall* timed = timed_call_new(OP_DELETE, call->cancellable, on_password_deleted, call, abandon_pipeline_call);
+        keyring_item_delete(timed, item);
+
+        g_list_free_full(items, g_object_unref);
+    }
+}
+
+// Start the delete pipeline for an account
+static void remove_account_password(PipelineCall* call)
+{
+    // Deleted because the account was removed
+    if (g_list_find(purple_accounts_get_all(), call->account) != NULL)
+        purple_account_set_remember_password(call->account, FALSE);
+    invalidate_cached_secret(call->context);
+    cancel_pending_store(call->account);
+    forget_written_secret(call->context);
+
+    /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) unlock_collection(plugin_collection, NULL, DELETING); */
+
+    TimedCall* timed = timed_call_new(OP_SEARCH, call->cancellable, delete_collection_password, call, abandon_pipeline_call);
+    keyring_search(timed, plugin_collection, call->context->attributes, SECRET_SEARCH_ALL | SECRET_SEARCH_LOAD_SECRETS);
+}
+
+// Submit a delete call, merged with a delete already pending for the account
+static void start_delete_call(PipelineCall* call)
+{
+    pipeline_submit(call, PIPELINE_DELETE, (plugin_backend == BACKEND_VAULT) ? remove_vault_password : remove_account_password);
+}
+
+// Delete password function
+static void delete_account_password(gpointer data, gpointer user_data)
+{
+    start_delete_call(pipeline_call_new((PurpleAccount*)data, NULL, NULL, NULL));
+}
+
+/**************************************************
+ **************************************************
+ ************** Bulk operations *******************
+ **************************************************
+ **************************************************/
+
+// Save all / delete all run, at most a window of pipeline calls is in flight
+typedef struct {
+    guint id; // done_data of the calls, late results of a dropped run are ignored
+    const gchar* action;
+    void (*start)(PipelineCall* call);
+    GQueue accounts;
+    guint total;
+    guint in_flight;
+    guint succeeded;
+    guint skipped;
+    guint failed;
+    guint cancelled;
+    guint logged; // finished calls when the progress was last logged
+    guint progress_timer;
+    gboolean scheduling;
+    GString* failures;
+    GCancellable* cancellable;
+} BulkOperation;
+
+BulkOperation* bulk_operation = NULL;
+guint bulk_next_id = 1;
+
+static void bulk_schedule(BulkOperation* bulk);
+static void bulk_cancel(BulkOperation* bulk, int choice);
+
+static guint bulk_done_count(BulkOperation* bulk)
+{
+    return bulk->succeeded + bulk->skipped + bulk->failed + bulk->cancelled;
+}
+
+// libpurple requests cannot be updated, the dialog is opened once and only offers to cancel
+static void bulk_show_progress(BulkOperation* bulk)
+{
+    gchar* msg = g_strdup_printf("Processing %u accounts, at most %i at a time.\nThe progress is written to the debug log.", bulk->total, MAX(purple_prefs_get_int(KEYRING_BULK_WINDOW_PREF), 1));
+
+    purple_request_action(bulk,
+        "Gnome Keyring",
+        "Keyring operation in progress",
+        msg,
+        0,
+        NULL,
+        NULL,
+        NULL,
+        bulk,
+        1,
+        "Cancel",
+        bulk_cancel);
+    g_free(msg);
+}
+
+// Counts go to the debug log, the summary dialog has the result
+static gboolean bulk_update_progress(gpointer data)
+{
+    BulkOperation* bulk = (BulkOperation*)data;
+
+    if (bulk_done_count(bulk) != bulk->logged) {
+        bulk->logged = bulk_done_count(bulk);
+        purple_debug_info(PLUGIN_ID, "Bulk operation: %u of %u accounts processed, %u skipped, %u failed\n", bulk->logged, bulk->total, bulk->skipped, bulk->failed);
+    }
+    return TRUE;
+}
+
+static void free_bulk_operation(BulkOperation* bulk)
+{
+    if (bulk->progress_timer != 0)
+        purple_timeout_remove(bulk->progress_timer);
+    purple_request_close_with_handle(bulk);
+
+    if (bulk_operation == bulk)
+        bulk_operation = NULL;
+
+    g_string_free(bulk->failures, TRUE);
+    g_object_unref(bulk->cancellable);
+    g_queue_clear(&bulk->accounts);
+    g_free(bulk);
+    count_free(LIVE_BULK);
 }
 
-/* End of collection functions */
+// Summary dialog instead of one dialog per failure
+static void bulk_finish(BulkOperation* bulk)
+{
+    GString* msg = g_string_new(NULL);
+    g_string_append_printf(msg, "%s %u of %u passwords", bulk->action, bulk->succeeded, bulk->total);
+    if (bulk->skipped > 0)
+        g_string_append_printf(msg, " (%u unchanged or without password)", bulk->skipped);
+    if (bulk->cancelled > 0)
+        g_string_append_printf(msg, " (%u cancelled)", bulk->cancelled);
 
-/**************************************************
- **************************************************
- ************ Store password pipline **************
- **************************************************
- **************************************************/
+    purple_debug_info(PLUGIN_ID, "Bulk operation finished: %s, %u failed\n", msg->str, bulk->failed);
+    purple_request_close_with_handle(bulk);
 
-// Error check
-static void on_item_created(GObject* source,
-    GAsyncResult* result,
-    gpointer user_data)
+    dialog((bulk->failed > 0) ? PURPLE_NOTIFY_MSG_ERROR : PURPLE_NOTIFY_MSG_INFO,
+        msg->str,
+        (bulk->failed > 0) ? bulk->failures->str : NULL);
+
+    g_string_free(msg, TRUE);
+    free_bulk_operation(bulk);
+}
+
+static void on_bulk_call_done(PurpleAccount* account, const GError* error, gboolean skipped, gpointer user_data)
 {
-    PurpleAccount* account = (PurpleAccount*)user_data;
-    GError* error = NULL;
-    SecretItem* item = secret_item_create_finish(result, &error);
+    BulkOperation* bulk = bulk_operation;
 
-    purple_debug_info(PLUGIN_ID, "Finished storing password\n");
+    // Run was dropped by the unload
+    if ((bulk == NULL) || (bulk->id != GPOINTER_TO_UINT(user_data)))
+        return;
 
-    if (error != NULL) {
-        print_protocol_error_message(purple_account_get_protocol_name(account), "Error saving passwort to keyring", error);
+    bulk->in_flight--;
+
+    if ((error == NULL) && skipped) {
+        bulk->skipped++;
+    } else if (error == NULL) {
+        bulk->succeeded++;
+    } else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        bulk->cancelled++;
     } else {
-        if (account->password != NULL) {
+        bulk->failed++;
+        g_string_append_printf(bulk->failures, "%s (%s): %s\n", account->username, purple_account_get_protocol_name(account), error->message);
+    }
 
-            // This will lead to crashes for some protocols, e.g. opensteamworks. Maybe time it or just use the signed on freeing...
-            /* purple_account_set_password(account, "Lorem ipsum dolor sit amet, consectetur adipiscing elit. Cras eu semper eros. Donec non gravida mi. Vestibulum ante ipsum primis in faucibus orci luctus et ultrices posuere cubilia Curae; Phasellus malesuada nisl eget est elementum, in ullamcorper nullam."); */
+    // Synchronous completions return to the running schedule loop
+    if (!bulk->scheduling)
+        bulk_schedule(bulk);
+}
 
-            /* g_free(account->password); */
-            /* account->password = NULL; */
+// Start calls until the in-flight window is full
+static void bulk_schedule(BulkOperation* bulk)
+{
+    guint window = MAX(purple_prefs_get_int(KEYRING_BULK_WINDOW_PREF), 1);
 
-            purple_debug_info(PLUGIN_ID, "Cleared password for %s with username %s\n", account->protocol_id, account->username);
-        }
+    bulk->scheduling = TRUE;
+    while ((bulk->in_flight < window) && !g_queue_is_empty(&bulk->accounts)) {
+        PurpleAccount* account = g_queue_pop_head(&bulk->accounts);
 
-        purple_debug_info(PLUGIN_ID, "%s password successfully saved for %s\n", account->protocol_id, account->username);
-        purple_account_set_remember_password(account, FALSE);
-        g_object_unref(item);
+        bulk->in_flight++;
+        bulk->start(pipeline_call_new(account, bulk->cancellable, on_bulk_call_done, GUINT_TO_POINTER(bulk->id)));
     }
+    bulk->scheduling = FALSE;
 
-    /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+    if ((bulk->in_flight == 0) && g_queue_is_empty(&bulk->accounts))
+        bulk_finish(bulk);
 }
 
-// Store password in the keyring
-static void store_account_password(gpointer data, gpointer user_data)
+// Cancel button of the progress dialog
+static void bulk_cancel(BulkOperation* bulk, int choice)
 {
-    /* unlock_collection(plugin_collection, NULL); */
-    PurpleAccount* account = (PurpleAccount*)data;
+    purple_debug_info(PLUGIN_ID, "Cancelling bulk operation\n");
+
+    bulk->cancelled += g_queue_get_length(&bulk->accounts);
+    g_queue_clear(&bulk->accounts);
+    g_cancellable_cancel(bulk->cancellable);
+}
 
-    GString* label = g_string_new(NULL);
-    g_string_append_printf(label, "Purple %s password for user: %s", purple_account_get_protocol_name(account), account->username);
+// Unload: cancel the running calls and drop their results without a summary
+static void bulk_abandon()
+{
+    if (bulk_operation == NULL)
+        return;
 
-    purple_debug_info(PLUGIN_ID, "Storing %s password with username %s\n", account->protocol_id, account->username);
-    secret_item_create(plugin_collection,
-        PURPLE_SCHEMA,
-        get_attributes(account),
-        label->str,
-        secret_value_new(purple_account_get_password(account), -1, "text/plain"),
-        SECRET_ITEM_CREATE_REPLACE,
-        NULL,
-        on_item_created,
-        data);
+    purple_debug_info(PLUGIN_ID, "Dropping bulk operation\n");
+    g_cancellable_cancel(bulk_operation->cancellable);
+    free_bulk_operation(bulk_operation);
+}
+
+static void bulk_start(const gchar* action, void (*start)(PipelineCall* call))
+{
+    if (bulk_operation != NULL) {
+        dialog(PURPLE_NOTIFY_MSG_WARNING, "Another keyring operation is still running.", "Please wait until it has finished.");
+        return;
+    }
 
-    g_string_free(label, FALSE);
+    BulkOperation* bulk = g_new0(BulkOperation, 1);
+    count_alloc(LIVE_BULK);
+    bulk->id = bulk_next_id++;
+    bulk->action = action;
+    bulk->start = start;
+    bulk->failures = g_string_new(NULL);
+    bulk->cancellable = g_cancellable_new();
+    g_queue_init(&bulk->accounts);
+
+    GList* accounts = purple_accounts_get_all();
+    for (GList* li = accounts; li != NULL; li = li->next)
+        g_queue_push_tail(&bulk->accounts, li->data);
+    bulk->total = g_queue_get_length(&bulk->accounts);
+
+    bulk_operation = bulk;
+
+    bulk_show_progress(bulk);
+    bulk->progress_timer = purple_timeout_add(KEYRING_BULK_PROGRESS_INTERVAL, bulk_update_progress, bulk);
+
+    bulk_schedule(bulk);
+}
+
+// Bulk store, writes directly since the bulk window already paces the keyring
+static void bulk_store_account_password(PipelineCall* call)
+{
+    // Removed meanwhile, skipped by the submit
+    if (call->context != NULL) {
+        cancel_pending_store(call->account);
+        invalidate_cached_secret(call->context);
+    }
+    start_store_call(call);
 }
 
 /**************************************************
  **************************************************
- ************* Load password pipline **************
+ ***************** Keyring sweep ******************
  **************************************************
  **************************************************/
 
-static void on_item_loaded(GObject* source,
+// One pass over all purple items of the collection, deleting the orphans of this profile
+typedef struct {
+    gboolean all; // every purple item, not only orphans and duplicates
+    gboolean report; // summary dialog when done
+    GQueue items; // SecretItems still to delete
+    guint total;
+    guint deleted;
+    guint failed;
+    guint in_flight;
+} Sweep;
+
+Sweep* sweep = NULL;
+
+static void sweep_schedule(Sweep* s);
+
+static void sweep_finish(Sweep* s)
+{
+    purple_debug_info(PLUGIN_ID, "Sweep finished: %u of %u items deleted, %u failed\n", s->deleted, s->total, s->failed);
+
+    if (s->report) {
+        gchar* msg = g_strdup_printf("Deleted %u of %u passwords", s->deleted, s->total);
+        dialog((s->failed > 0) ? PURPLE_NOTIFY_MSG_ERROR : PURPLE_NOTIFY_MSG_INFO, msg, NULL);
+        g_free(msg);
+    }
+
+    sweep = NULL;
+    g_free(s);
+    count_free(LIVE_BULK);
+}
+
+static void on_sweep_item_deleted(GObject* source,
     GAsyncResult* result,
     gpointer user_data)
 {
-    PurpleAccount* account = (PurpleAccount*)user_data;
-
+    Sweep* s = (Sweep*)user_data;
     GError* error = NULL;
-    GList* items = secret_collection_search_finish(plugin_collection, result, &error);
+
+    secret_item_delete_finish(SECRET_ITEM(source), result, &error);
 
     if (error != NULL) {
-        print_protocol_error_message(purple_account_get_protocol_name(account), "Could not read password", error);
+        record_operation_error(OP_DELETE);
+        purple_debug_info(PLUGIN_ID, "Could not delete item: %s\n", error->message);
+        s->failed++;
         g_error_free(error);
-    } else if (items == NULL) {
-        purple_debug_info(PLUGIN_ID, "%s: Password is empty - no password saved\n", account->protocol_id);
     } else {
-        SecretItem* item = items->data;
-        SecretValue* value = secret_item_get_secret(item);
-
-        purple_debug_info(PLUGIN_ID, "Setting password for %s with username %s\n", account->protocol_id, account->username);
-        purple_account_set_password(account, secret_value_get_text(value));
+        GHashTable* attributes = secret_item_get_attributes(SECRET_ITEM(source));
 
-        secret_value_unref(value);
-        g_object_unref(item);
-        g_list_free(items);
+        if (g_hash_table_contains(attributes, "version")) {
+            gchar* key = get_index_key(g_hash_table_lookup(attributes, "protocol"), g_hash_table_lookup(attributes, "username"));
+            forget_item_path(key, SECRET_ITEM(source));
+            g_free(key);
+        }
+        g_hash_table_unref(attributes);
+        s->deleted++;
     }
+
+    s->in_flight--;
+    sweep_schedule(s);
 }
 
-// Load password of account from secret collection
-static void load_account_password(gpointer data, gpointer user_data)
+// Keep up to bulk window deletes in flight
+static void sweep_schedule(Sweep* s)
 {
-    PurpleAccount* account = (PurpleAccount*)data;
-
-    if (!purple_account_get_remember_password(account)) {
+    guint window = MAX(purple_prefs_get_int(KEYRING_BULK_WINDOW_PREF), 1);
+    SecretItem* item = NULL;
 
-        /* unlock_collection(plugin_collection); */
-        purple_debug_info(PLUGIN_ID, "Loading password %s with username %s\n", account->protocol_id, account->username);
-
-        secret_collection_search(plugin_collection,
-            PURPLE_SCHEMA,
-            get_attributes(account),
-            SECRET_SEARCH_UNLOCK | SECRET_SEARCH_LOAD_SECRETS,
-            NULL,
-            on_item_loaded,
-            data);
+    while ((s->in_flight < window) && ((item = g_queue_pop_head(&s->items)) != NULL)) {
+        TimedCall* timed = timed_call_new(OP_DELETE, NULL, on_sweep_item_deleted, s, NULL);
 
-        /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+        s->in_flight++;
+        keyring_item_delete(timed, item);
+        g_object_unref(item);
     }
+
+    if ((s->in_flight == 0) && g_queue_is_empty(&s->items))
+        sweep_finish(s);
 }
 
-/**************************************************
- **************************************************
- ************ Delete password pipline *************
- **************************************************
- **************************************************/
+static void sweep_queue_item(Sweep* s, SecretItem* item)
+{
+    purple_debug_info(PLUGIN_ID, "Deleting item %s\n", g_dbus_proxy_get_object_path(G_DBUS_PROXY(item)));
+    g_queue_push_tail(&s->items, g_object_ref(item));
+}
 
-// Deleted callback
-static void on_password_deleted(GObject* source,
+/*
+ * Orphans: items this profile wrote or read (their path is known) whose account does not exist anymore.
+ * Items of other profiles sharing the keyring, duplicates and version 1 items are left alone.
+ * All: every item of a known account, items of unknown accounts stay.
+ */
+static void on_sweep_items_loaded(GObject* source,
     GAsyncResult* result,
     gpointer user_data)
 {
+    Sweep* s = (Sweep*)user_data;
+    GHashTable* account_keys = g_hash_table_new(g_str_hash, g_str_equal);
+    GHashTable* found = g_hash_table_new(g_str_hash, g_str_equal);
 
-    PurpleAccount* account = (PurpleAccount*)user_data;
     GError* error = NULL;
-    gboolean success = secret_item_delete_finish(SECRET_ITEM(source), result, &error);
+    GList* items = secret_collection_search_finish(plugin_collection, result, &error);
+    track_items(items);
 
     if (error != NULL) {
-        print_protocol_error_message(account->protocol_id, "Could not delete password.", error);
-    } else {
-        if (success)
-            purple_debug_info(PLUGIN_ID, "Successfully deteted password for %s\n", account->protocol_id);
-        else
-            purple_debug_info(PLUGIN_ID, "Could not detete password for %s, but no error occured\n", account->protocol_id);
+        record_operation_error(OP_SEARCH);
+        s->failed++;
+        if (s->report)
+            dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not search the keyring.", error->message);
     }
 
-    /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+    for (GList* li = purple_accounts_get_all(); li != NULL; li = li->next)
+        g_hash_table_add(account_keys, get_account_context(li->data)->key);
+
+    for (GList* li = items; li != NULL; li = li->next) {
+        SecretItem* item = li->data;
+        GHashTable* attributes = secret_item_get_attributes(item);
+        const gchar* path = g_dbus_proxy_get_object_path(G_DBUS_PROXY(item));
+        gchar* key = NULL;
+
+        g_hash_table_add(found, (gpointer)path);
+
+        if (s->all) {
+            // Only the items of this profile, other profiles may share the keyring
+            if (!g_hash_table_contains(attributes, "version")) {
+                if (count_legacy_accounts(g_hash_table_lookup(attributes, "username"), NULL) > 0)
+                    sweep_queue_item(s, item);
+            } else {
+                key = get_index_key(g_hash_table_lookup(attributes, "protocol"), g_hash_table_lookup(attributes, "username"));
+                if (g_hash_table_contains(account_keys, key))
+                    sweep_queue_item(s, item);
+            }
+        } else if (g_hash_table_contains(attributes, "version")) {
+            key = get_index_key(g_hash_table_lookup(attributes, "protocol"), g_hash_table_lookup(attributes, "username"));
+            if (!g_hash_table_contains(account_keys, key) && (g_strcmp0(path, g_hash_table_lookup(item_paths, key)) == 0))
+                sweep_queue_item(s, item);
+        }
+
+        g_free(key);
+        g_hash_table_unref(attributes);
+    }
+
+    // Paths of deleted accounts whose item is gone already
+    if ((error == NULL) && !s->all) {
+        GHashTableIter iter;
+        gpointer key, path;
+        gboolean paths_changed = FALSE;
+
+        g_hash_table_iter_init(&iter, item_paths);
+        while (g_hash_table_iter_next(&iter, &key, &path)) {
+            if (!g_hash_table_contains(account_keys, key) && !g_hash_table_contains(found, path)) {
+                g_hash_table_iter_remove(&iter);
+                paths_changed = TRUE;
+            }
+        }
+        if (paths_changed)
+            save_item_paths();
+    }
+
+    if (error != NULL)
+        g_error_free(error);
+    g_hash_table_unref(found);
+    g_hash_table_unref(account_keys);
+    g_list_free_full(items, g_object_unref);
+
+    s->total = g_queue_get_length(&s->items);
+    sweep_schedule(s);
 }
 
-// Delete from collection
-static void delete_collection_password(GObject* source,
-    GAsyncResult* result,
-    gpointer user_data)
+// List all purple items with one search, then delete the unwanted ones
+static gboolean start_sweep(gboolean all, gboolean report)
 {
+    if ((sweep != NULL) || (bulk_operation != NULL)) {
+        if (report)
+            dialog(PURPLE_NOTIFY_MSG_WARNING, "Another keyring operation is still running.", "Please wait until it has finished.");
+        return FALSE;
+    }
 
-    PurpleAccount* account = (PurpleAccount*)user_data;
-    GError* error = NULL;
-    GList* items = secret_collection_search_finish(plugin_collection, result, &error);
+    if ((plugin_state != COLLECTION_READY) || schema_migrating) {
+        purple_debug_info(PLUGIN_ID, "Collection not ready, skipping sweep\n");
+        if (report)
+            dialog(PURPLE_NOTIFY_MSG_WARNING, "The keyring is not unlocked yet.", "Please try again once it is unlocked.");
+        request_unlock();
+        return FALSE;
+    }
 
-    if (error != NULL) {
-        print_protocol_error_message(purple_account_get_protocol_name(account), "Could not delete password", error);
-    } else if (items == NULL) {
-        purple_debug_info(PLUGIN_ID, "%s: No password found for deletion\n", account->protocol_id);
-        /* print_protocol_info_message(purple_account_get_protocol_name(account), "Password is empty or no password given"); */
-    } else {
-        SecretItem* item = items->data;
+    if (plugin_backend == BACKEND_VAULT) {
+        sweep_vault(all, report);
+        return TRUE;
+    }
 
-        // Not valid operation if account is deleted -> separate it
-        /* SecretValue* value  = secret_item_get_secret(item); */
-        /* purple_account_set_password(account, secret_value_get_text(value)); */
-        /* secret_value_unref(value); */
+    Sweep* s = g_new0(Sweep, 1);
+    count_alloc(LIVE_BULK);
+    s->all = all;
+    s->report = report;
+    g_queue_init(&s->items);
+    sweep = s;
 
-        secret_item_delete(item, NULL, on_password_deleted, user_data);
+    GHashTable* attributes = secret_attributes_build(PURPLE_SCHEMA, NULL);
+    TimedCall* timed = timed_call_new(OP_SEARCH, NULL, on_sweep_items_loaded, s, NULL);
 
-        g_object_unref(item);
-        g_list_free(items);
-    }
+    keyring_search(timed, plugin_collection, attributes, SECRET_SEARCH_ALL);
+
+    g_hash_table_unref(attributes);
+    return TRUE;
 }
 
-// Delete password function
-static void delete_account_password(gpointer data, gpointer user_data)
+// Startup timer
+static gboolean sweep_orphans(gpointer data)
 {
-    PurpleAccount* account = (PurpleAccount*)data;
+    sweep_timer = 0;
+    start_sweep(FALSE, FALSE);
+    return FALSE;
+}
 
-    purple_account_set_remember_password(account, FALSE);
+// Running deletes are abandoned by the unload
+static void cancel_sweep()
+{
+    SecretItem* item = NULL;
 
-    /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) unlock_collection(plugin_collection, NULL, DELETING); */
+    if (sweep_timer != 0) {
+        purple_timeout_remove(sweep_timer);
+        sweep_timer = 0;
+    }
 
-    secret_collection_search(plugin_collection,
-        PURPLE_SCHEMA,
-        get_attributes(account),
-        SECRET_SEARCH_ALL | SECRET_SEARCH_LOAD_SECRETS,
-        NULL,
-        delete_collection_password,
-        data);
+    if (sweep == NULL)
+        return;
+
+    while ((item = g_queue_pop_head(&sweep->items)) != NULL)
+        g_object_unref(item);
+    g_free(sweep);
+    sweep = NULL;
+    count_free(LIVE_BULK);
 }
 
 /**************************************************
@@ -649,20 +4952,140 @@ static void delete_account_password(gpointer data, gpointer user_data)
 // Store all passwords action
 static void save_all_passwords(PurplePluginAction* action)
 {
-    gpointer user_data = NULL;
-    GList* accounts = purple_accounts_get_all();
-    g_list_foreach(accounts, store_account_password, user_data);
-    /* purple_notify_info(gnome_keyring_plugin, "Gnome Keyring Info", "Finished saving of passwords to keyring"); */
+    bulk_start("Saved", bulk_store_account_password);
 }
 
 // Delete all passwords from keyring action
 static void delete_all_passwords(PurplePluginAction* action)
 {
-    gpointer user_data = NULL;
+    if (!start_sweep(TRUE, TRUE))
+        return;
+
+    for (GList* li = purple_accounts_get_all(); li != NULL; li = li->next) {
+        AccountContext* context = get_account_context(li->data);
+
+        purple_account_set_remember_password(li->data, FALSE);
+        forget_account_item_path(context);
+        invalidate_cached_secret(context);
+        cancel_pending_store(li->data);
+        forget_written_secret(context);
+    }
+}
+
+static void on_sweep_confirmed(gpointer data, int choice)
+{
+    start_sweep(FALSE, TRUE);
+}
+
+// Remove orphaned passwords action, deleted passwords cannot be restored
+static void sweep_passwords(PurplePluginAction* action)
+{
+    purple_request_action(gnome_keyring_plugin,
+        "Gnome Keyring",
+        "Remove passwords of deleted accounts?",
+        "The passwords this messenger stored for accounts that no longer exist are deleted from the keyring. This cannot be undone.",
+        1,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        2,
+        "Remove",
+        on_sweep_confirmed,
+        "Cancel",
+        NULL);
+}
+
+// Write the statistics as JSON to the purple user dir
+static void dump_statistics(gpointer data, int choice)
+{
+    gchar* json = get_stats_json();
+    gchar* path = g_build_filename(purple_user_dir(), KEYRING_STATS_FILE, NULL);
+
+    if (purple_util_write_data_to_file_absolute(path, json, -1))
+        dialog(PURPLE_NOTIFY_MSG_INFO, "Keyring statistics saved.", path);
+    else
+        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not save keyring statistics.", path);
+
+    purple_debug_info(PLUGIN_ID, "Keyring statistics: %s", json);
+
+    g_free(path);
+    g_free(json);
+}
+
+// Store the accounts picked in the connect first dialog
+static void save_connect_first(gpointer data, PurpleRequestFields* fields)
+{
     GList* accounts = purple_accounts_get_all();
-    g_list_foreach(accounts, delete_account_password, user_data);
+    GList* keys = NULL;
+
+    for (GList* li = accounts; li != NULL; li = li->next) {
+        const gchar* key = get_account_context(li->data)->key;
+
+        if (purple_request_fields_exists(fields, key) && purple_request_fields_get_bool(fields, key))
+            keys = g_list_prepend(keys, (gpointer)key);
+    }
+
+    purple_prefs_set_string_list(KEYRING_CONNECT_FIRST_PREF, keys);
+    g_list_free(keys);
+}
+
+// Connect first action, lets the user pick the accounts whose passwords are loaded first at startup
+static void choose_connect_first(PurplePluginAction* action)
+{
+    PurpleRequestFields* fields = purple_request_fields_new();
+    PurpleRequestFieldGroup* group = purple_request_field_group_new(NULL);
+    GHashTable* priorities = load_account_priorities();
+
+    for (GList* li = purple_accounts_get_all(); li != NULL; li = li->next) {
+        PurpleAccount* account = li->data;
+        gchar* label = g_strdup_printf("%s (%s)", account->username, purple_account_get_protocol_name(account));
+
+        purple_request_field_group_add_field(group,
+            purple_request_field_bool_new(get_account_context(account)->key,
+                label,
+                get_account_priority(priorities, account) == PRIORITY_CONNECT_FIRST));
+        g_free(label);
+    }
+    purple_request_fields_add_group(fields, group);
+    g_hash_table_unref(priorities);
+
+    purple_request_fields(gnome_keyring_plugin,
+        "Gnome Keyring",
+        "Accounts to connect first",
+        "The passwords of these accounts are loaded before all others when the messenger starts",
+        fields,
+        "Save",
+        G_CALLBACK(save_connect_first),
+        "Cancel",
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL);
+}
+
+// Show keyring statistics action
+static void show_statistics(PurplePluginAction* action)
+{
+    gchar* text = get_stats_text();
+
+    purple_request_action(gnome_keyring_plugin,
+        "Gnome Keyring",
+        "Keyring statistics",
+        text,
+        0,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        2,
+        "Close",
+        NULL,
+        "Save as JSON",
+        dump_statistics);
 
-    /* purple_notify_info(gnome_keyring_plugin, "Gnome Keyring Info", "Finished deleting of passwords from keyring", NULL); */
+    g_free(text);
 }
 
 /**************************************************
@@ -691,17 +5114,34 @@ static void account_added(PurpleAccount* account, gpointer data)
 // Signal account removed action
 static void account_removed(PurpleAccount* account, gpointer data)
 {
+    // The account is freed after this signal, a queued store would run with it
+    cancel_pending_store(account);
+
+    // Already taken off the account list, the delete call only gets an existing context
+    get_account_context(account);
     delete_account_password(account, NULL);
+    release_account_context(account);
     purple_debug_info(PLUGIN_ID, "Deleted %s with username %s\n", account->protocol_id, account->username);
 }
 
 // Account enabled
 static void account_enabled(PurpleAccount* account, gpointer data)
 {
-    load_account_password(account, NULL);
+    // Already loaded by the init pipeline, or loaded when the account connects
+    if (!g_hash_table_contains(init_pending, account) && !purple_prefs_get_bool(KEYRING_ON_DEMAND_PREF))
+        load_account_password(account, NULL);
+    else
+        check_password_wanted(account);
     purple_debug_info(PLUGIN_ID, "Enabled %s with username %s\n", account->protocol_id, account->username);
 }
 
+// Account status changed, going online signs the account on
+static void account_status_changed(PurpleAccount* account, PurpleStatus* old_status, PurpleStatus* new_status, gpointer data)
+{
+    if (purple_status_is_online(new_status))
+        check_password_wanted(account);
+}
+
 // Account disabled
 static void account_disabled(PurpleAccount* account, gpointer data)
 {
@@ -712,6 +5152,9 @@ static void account_disabled(PurpleAccount* account, gpointer data)
 static void account_signed_on(PurpleAccount* account, gpointer data)
 {
     static const char* lorem = "Lorem ipsum dolor sit amet, consectetur adipiscing elit. Cras eu semper eros. Donec non gravida mi. Vestibulum ante ipsum primis in faucibus orci luctus et ultrices posuere cubilia Curae; Phasellus malesuada nisl eget est elementum, in ullamcorper nullam.";
+    AccountContext* context = get_account_context(account);
+
+    record_account_usage(context);
 
     if ((account->password != NULL) && (purple_account_get_remember_password(account))) {
         store_account_password(account, data);
@@ -749,17 +5192,25 @@ static void account_connection_error(PurpleAccount* account, PurpleConnectionErr
             account);
 
     } else if (err == PURPLE_CONNECTION_ERROR_NETWORK_ERROR) {
-        load_account_password(account, NULL);
-        purple_debug_info(PLUGIN_ID, "Enabled %s with username %s\n", account->protocol_id, account->username);
+        prefetch_account(account);
     }
 }
 
+// Network configuration changed
+static void network_changed(gpointer data)
+{
+    if (purple_network_is_available())
+        prefetch_reconnecting_accounts();
+}
+
 // Core quitting
 static void core_quitting(gpointer data)
 {
     printf("quitting purple gnome keyring");
     purple_debug_info(PLUGIN_ID, "Quitting");
     purple_prefs_set_int(KEYRING_PLUG_STATUS_PREF, ENABLED);
+
+    forget_held_accounts();
 }
 
 /**************************************************
@@ -786,6 +5237,15 @@ static GList* plugin_actions(PurplePlugin* plugin, gpointer context)
     action = purple_plugin_action_new(action_label->str, delete_all_passwords);
     list = g_list_append(list, action);
 
+    action = purple_plugin_action_new("Remove passwords of deleted accounts", sweep_passwords);
+    list = g_list_append(list, action);
+
+    action = purple_plugin_action_new("Accounts to connect first", choose_connect_first);
+    list = g_list_append(list, action);
+
+    action = purple_plugin_action_new("Keyring statistics", show_statistics);
+    list = g_list_append(list, action);
+
     return list;
 }
 
@@ -808,6 +5268,12 @@ static PurplePluginPrefFrame* get_plugin_pref_frame(PurplePlugin* plugin)
     ppref = purple_plugin_pref_new_with_label("Gnome Keyring settings");
     purple_plugin_pref_frame_add(frame, ppref);
 
+    ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_BACKEND_PREF, "Store passwords in (applies when the plugin is loaded again): ");
+    purple_plugin_pref_set_type(ppref, PURPLE_PLUGIN_PREF_CHOICE);
+    purple_plugin_pref_add_choice(ppref, "Gnome Keyring", GINT_TO_POINTER(BACKEND_KEYRING));
+    purple_plugin_pref_add_choice(ppref, "Encrypted file (without Gnome Keyring, e.g. headless Finch)", GINT_TO_POINTER(BACKEND_VAULT));
+    purple_plugin_pref_frame_add(frame, ppref);
+
     ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_CUSTOM_NAME_PREF, "Use custom keyring (not default).\nYou must check this box to use the <Gnome Keyring name> option below");
     purple_plugin_pref_frame_add(frame, ppref);
 
@@ -820,6 +5286,38 @@ static PurplePluginPrefFrame* get_plugin_pref_frame(PurplePlugin* plugin)
     ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_AUTO_LOCK_PREF, "Lock keyring when closing messenger");
     purple_plugin_pref_frame_add(frame, ppref);
 
+    ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_LAZY_INIT_PREF, "Lazy start: do not load all keyring items (faster with large keyrings)");
+    purple_plugin_pref_frame_add(frame, ppref);
+
+    ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_ON_DEMAND_PREF, "Load passwords only when an account connects (not all at startup)");
+    purple_plugin_pref_frame_add(frame, ppref);
+
+    ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_SWEEP_PREF, "Remove passwords of deleted accounts from the keyring at startup");
+    purple_plugin_pref_frame_add(frame, ppref);
+
+    ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_BULK_WINDOW_PREF, "Parallel keyring calls for save / delete all: ");
+    purple_plugin_pref_set_bounds(ppref, 1, 64);
+    purple_plugin_pref_frame_add(frame, ppref);
+
+    ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_CACHE_PREF, "Cache passwords in locked memory (saves keyring lookups on reconnect)");
+    purple_plugin_pref_frame_add(frame, ppref);
+
+    ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_CACHE_TTL_PREF, "Cache lifetime in seconds: ");
+    purple_plugin_pref_set_bounds(ppref, 1, 86400);
+    purple_plugin_pref_frame_add(frame, ppref);
+
+    ppref = purple_plugin_pref_new_with_label("Deadlines of keyring calls in seconds (0 = wait forever)");
+    purple_plugin_pref_frame_add(frame, ppref);
+
+    for (guint op = 0; op < OP_COUNT; op++) {
+        gchar* label = g_strdup_printf("%s: ", operation_names[op]);
+
+        ppref = purple_plugin_pref_new_with_name_and_label(operation_deadline_prefs[op], label);
+        purple_plugin_pref_set_bounds(ppref, 0, 600);
+        purple_plugin_pref_frame_add(frame, ppref);
+        g_free(label);
+    }
+
     return frame;
 }
 
@@ -827,7 +5325,25 @@ static PurplePluginPrefFrame* get_plugin_pref_frame(PurplePlugin* plugin)
 static gboolean plugin_load(PurplePlugin* plugin)
 {
     /* purple_debug_info(PLUGIN_ID, "Loading plugin"); */
+    GError* error = NULL;
+
     gnome_keyring_plugin = plugin;
+    if (!read_random_bytes(written_hash_key, sizeof(written_hash_key), &error)) {
+        purple_debug_error(PLUGIN_ID, "%s\n", error->message);
+        dialog(PURPLE_NOTIFY_MSG_ERROR, "Could not load the Gnome Keyring plugin.", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    plugin_cancellable = g_cancellable_new();
+
+    item_paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    init_pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+    account_contexts = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free_account_context);
+    cache_purge_timer = purple_timeout_add_seconds(KEYRING_CACHE_PURGE_INTERVAL, purge_secret_cache, NULL);
+    load_item_paths();
+
+    pending_stores = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free_pending_store);
 
     // Handles
     void* core_handle = purple_get_core();
@@ -841,14 +5357,27 @@ static gboolean plugin_load(PurplePlugin* plugin)
     purple_signal_connect(accounts_handle, "account-disabled", plugin, PURPLE_CALLBACK(account_disabled), NULL);
     purple_signal_connect(accounts_handle, "account-signed-on", plugin, PURPLE_CALLBACK(account_signed_on), NULL);
     purple_signal_connect(accounts_handle, "account-connection-error", plugin, PURPLE_CALLBACK(account_connection_error), NULL);
+    purple_signal_connect(accounts_handle, "account-status-changed", plugin, PURPLE_CALLBACK(account_status_changed), NULL);
+
+    // Network signals
+    purple_signal_connect(purple_network_get_handle(), "network-configuration-changed", plugin, PURPLE_CALLBACK(network_changed), NULL);
 
     if (purple_prefs_get_bool(KEYRING_AUTO_SAVE_PREF)) {
         purple_signal_connect(accounts_handle, "account-added", plugin, PURPLE_CALLBACK(account_added), NULL);
         purple_signal_connect(accounts_handle, "account-removed", plugin, PURPLE_CALLBACK(account_removed), NULL);
     }
 
-    // Load collection when plugin is activated
-    init_secret_service();
+    hold_init_accounts();
+
+    // Load collection when plugin is activated, the backend is only switched here
+    plugin_backend = purple_prefs_get_int(KEYRING_BACKEND_PREF);
+    if (plugin_backend == BACKEND_VAULT) {
+        init_vault();
+    } else {
+        start_keyring_worker();
+        init_secret_service();
+        watch_secret_service();
+    }
 
     if (purple_prefs_get_int(KEYRING_PLUG_STATUS_PREF) == UNLOADED) {
         purple_request_action(plugin,
@@ -870,8 +5399,8 @@ static gboolean plugin_load(PurplePlugin* plugin)
     purple_prefs_set_int(KEYRING_PLUG_STATUS_PREF, LOADED);
 
     // Pref callbacks
-    /* purple_prefs_connect_callback(plugin, KEYRING_CUSTOM_NAME_PREF, (PurplePrefCallback)custom_name_changed, NULL); */
-    /* purple_prefs_trigger_callback(KEYRING_CUSTOM_NAME_PREF); */
+    purple_prefs_connect_callback(plugin, KEYRING_CUSTOM_NAME_PREF, keyring_name_changed, NULL);
+    purple_prefs_connect_callback(plugin, KEYRING_NAME_PREF, keyring_name_changed, NULL);
 
     return TRUE;
 }
@@ -882,16 +5411,80 @@ static gboolean plugin_unload(PurplePlugin* plugin)
     printf("unloading purple gnome keyring\n");
     purple_debug_info(PLUGIN_ID, "Unloading plugin\n");
 
+    bulk_abandon();
+
+    // Last writes are still sent, but not cancelled with everything else
+    plugin_unloading = TRUE;
+    unload_cancellable = g_cancellable_new();
+
+    // Do not lose queued stores
+    if (store_flush_timer != 0) {
+        purple_timeout_remove(store_flush_timer);
+        flush_pending_stores(NULL);
+    }
+
     if (purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF))
         lock_collection();
-    g_object_unref(plugin_collection);
+    g_clear_object(&plugin_collection);
+
+    // Results of outstanding calls are dropped from here on
+    plugin_generation++;
+    g_cancellable_cancel(plugin_cancellable);
+    g_clear_object(&plugin_cancellable);
+    plugin_unloading = FALSE;
+
+    if (resolve_collection_timer != 0) {
+        purple_timeout_remove(resolve_collection_timer);
+        resolve_collection_timer = 0;
+    }
+    g_clear_pointer(&resolved_keyring, g_free);
+
+    if (plugin_service != NULL) {
+        g_signal_handler_disconnect(plugin_service, service_signal_handler);
+        g_clear_object(&plugin_service);
+    }
+    accounts_initialized = FALSE;
     secret_service_disconnect();
 
+    if (secrets_watch != 0)
+        g_bus_unwatch_name(secrets_watch);
+    secrets_watch = 0;
+    g_clear_pointer(&secrets_owner, g_free);
+    secrets_lost = FALSE;
+    service_generation++;
+
+    g_hash_table_destroy(item_paths);
+    g_hash_table_destroy(init_pending);
+    init_pending = NULL;
+
+    purple_timeout_remove(cache_purge_timer);
+    if (hold_timer != 0) {
+        purple_timeout_remove(hold_timer);
+        hold_timer = 0;
+    }
+    cancel_schema_migration();
+    cancel_sweep();
+    close_vault();
+    release_held_accounts();
+    purple_request_close_with_handle(plugin);
+    release_account_contexts();
+
+    // Calls waiting for the collection will not run anymore
+    GError* unloaded = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Plugin was unloaded");
+    resume_waiting_calls(unloaded);
+    g_error_free(unloaded);
+    plugin_state = COLLECTION_PENDING;
+    unlock_init = FALSE;
+    stop_keyring_worker();
+    g_clear_object(&unload_cancellable);
+
+    g_hash_table_destroy(pending_stores);
+
     if (purple_prefs_get_int(KEYRING_PLUG_STATUS_PREF) == LOADED)
         purple_prefs_set_int(KEYRING_PLUG_STATUS_PREF, UNLOADED);
 
     purple_signals_disconnect_by_handle(plugin);
-    /* purple_prefs_disconnect_by_handle(plugin); */
+    purple_prefs_disconnect_by_handle(plugin);
 
     return TRUE;
 }
@@ -942,16 +5535,32 @@ static PurplePluginInfo info = {
 static void init_plugin(PurplePlugin* plugin)
 {
     purple_prefs_add_none("/plugins/core/purple_gnome_keyring");
+    purple_prefs_add_int(KEYRING_BACKEND_PREF, KEYRING_BACKEND_DEFAULT);
     purple_prefs_add_bool(KEYRING_CUSTOM_NAME_PREF, KEYRING_CUSTOM_NAME_DEFAULT);
     purple_prefs_add_string(KEYRING_NAME_PREF, KEYRING_NAME_DEFAULT);
+    purple_prefs_add_string(KEYRING_COLLECTION_PATH_PREF, KEYRING_COLLECTION_PATH_DEFAULT);
 
     purple_prefs_add_bool(KEYRING_AUTO_SAVE_PREF, KEYRING_AUTO_SAVE_DEFAULT);
     purple_prefs_add_bool(KEYRING_AUTO_LOCK_PREF, KEYRING_AUTO_LOCK_DEFAULT);
+    purple_prefs_add_bool(KEYRING_LAZY_INIT_PREF, KEYRING_LAZY_INIT_DEFAULT);
+    purple_prefs_add_bool(KEYRING_ON_DEMAND_PREF, KEYRING_ON_DEMAND_DEFAULT);
+    purple_prefs_add_bool(KEYRING_SWEEP_PREF, KEYRING_SWEEP_DEFAULT);
+    purple_prefs_add_string_list(KEYRING_CONNECT_FIRST_PREF, NULL);
+    purple_prefs_add_string_list(KEYRING_RECENT_PREF, NULL);
 
     purple_prefs_add_int(KEYRING_PLUG_STATUS_PREF, KEYRING_PLUG_STATUS_DEFAULT);
+    purple_prefs_add_string_list(KEYRING_ITEM_PATHS_PREF, NULL);
+    purple_prefs_add_int(KEYRING_BULK_WINDOW_PREF, KEYRING_BULK_WINDOW_DEFAULT);
+    purple_prefs_add_bool(KEYRING_CACHE_PREF, KEYRING_CACHE_DEFAULT);
+    purple_prefs_add_int(KEYRING_CACHE_TTL_PREF, KEYRING_CACHE_TTL_DEFAULT);
+
+    purple_prefs_add_none(KEYRING_DEADLINE_PREF);
+    for (guint op = 0; op < OP_COUNT; op++)
+        purple_prefs_add_int(operation_deadline_prefs[op], operation_deadline_defaults[op]);
 
     purple_prefs_remove("/plugins/core/purple_gnome_keyring/keyring_name");
     purple_prefs_remove("/plugins/core/purple_gnome_keyring/plug_state");
+    purple_prefs_remove("/plugins/core/purple_gnome_keyring/schema_version");
 }
 
 PURPLE_INIT_PLUGIN(gnome_keyring, init_plugin, info)